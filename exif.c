@@ -0,0 +1,225 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "exif.h"
+
+enum {
+	TAG_ORIENTATION = 0x0112,
+	TAG_DATETIME    = 0x0132,
+	TAG_EXIFIFD     = 0x8769,
+	TAG_ORIGINAL    = 0x9003,
+	TAG_DIGITIZED   = 0x9004,
+};
+
+enum { T_ASCII = 2, T_SHORT = 3, T_LONG = 4 };
+
+/* the TIFF structure inside APP1, offsets relative to its header */
+struct tiff {
+	const uint8_t *p;
+	size_t len;
+	bool be;
+};
+
+/* dates in order of preference */
+struct dates {
+	time_t t[3];
+};
+
+static unsigned
+u16(const struct tiff *tf, size_t o) {
+	const uint8_t *p = tf->p + o;
+	return tf->be ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+}
+
+static uint32_t
+u32(const struct tiff *tf, size_t o) {
+	const uint8_t *p = tf->p + o;
+	return tf->be ? (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]
+	              : (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+/* days since 1970-01-01 of a date in the proleptic Gregorian calendar */
+static int64_t
+days(int y, int m, int d) {
+	int64_t era;
+	int yoe, doy;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/*
+ * The local zone's offset from UTC at t. mktime() reloads the zone and
+ * takes the global zone lock on every call; this asks localtime_r()
+ * once for each hour of timestamps a thread sees.
+ */
+static long
+utcoff(time_t t) {
+	static __thread bool valid;
+	static __thread time_t hour;
+	static __thread long off;
+	struct tm tm;
+
+	if (!valid || t / 3600 != hour) {
+		if (!localtime_r(&t, &tm))
+			return 0;
+		valid = true;
+		hour = t / 3600;
+		off = tm.tm_gmtoff;
+	}
+	return off;
+}
+
+static int
+num(const char *s, int n) {
+	int v = 0;
+
+	for (int i = 0; i < n; ++i) {
+		if (s[i] < '0' || s[i] > '9')
+			return -1;
+		v = 10 * v + s[i] - '0';
+	}
+	return v;
+}
+
+/* "YYYY:MM:DD HH:MM:SS" as local time, as mktime() would, or 0 */
+static time_t
+datetime(const char *s) {
+	int y = num(s, 4), mo = num(s + 5, 2), d = num(s + 8, 2);
+	int h = num(s + 11, 2), mi = num(s + 14, 2), sec = num(s + 17, 2);
+	time_t t;
+
+	if (s[4] != ':' || s[7] != ':' || s[10] != ' ' || s[13] != ':' || s[16] != ':')
+		return 0;
+	if (y < 1 || mo < 1 || mo > 12 || d < 1 || d > 31 || h < 0 || h > 23
+	 || mi < 0 || mi > 59 || sec < 0 || sec > 60)
+		return 0;
+	t = days(y, mo, d) * 86400 + h * 3600 + mi * 60 + sec;
+	/* the offset at the UTC guess may be an hour off around a change */
+	return t - utcoff(t - utcoff(t));
+}
+
+static void
+ifd(const struct tiff *tf, uint32_t off, struct exifmeta *m, struct dates *dt, int depth) {
+	unsigned n;
+
+	if (tf->len < 2 || off > tf->len - 2)
+		return;
+	n = u16(tf, off);
+	for (unsigned i = 0; i < n; ++i) {
+		size_t e = off + 2 + 12 * (size_t)i;
+		unsigned tag, type;
+		uint32_t count, val;
+		int slot;
+
+		if (e + 12 > tf->len)
+			return;
+		tag = u16(tf, e);
+		type = u16(tf, e + 2);
+		count = u32(tf, e + 4);
+		val = u32(tf, e + 8);
+
+		switch (tag) {
+		case TAG_ORIENTATION:
+			if (type == T_SHORT && count == 1)
+				m->orient = u16(tf, e + 8);
+			continue;
+		case TAG_EXIFIFD:
+			if (type == T_LONG && !depth)
+				ifd(tf, val, m, dt, depth + 1);
+			continue;
+		case TAG_ORIGINAL:
+			slot = 0;
+			break;
+		case TAG_DIGITIZED:
+			slot = 1;
+			break;
+		case TAG_DATETIME:
+			slot = 2;
+			break;
+		default:
+			continue;
+		}
+		/* 19 characters and a NUL, never inline */
+		if (type == T_ASCII && count >= 20 && val <= tf->len && tf->len - val >= 19)
+			dt->t[slot] = datetime((const char *)tf->p + val);
+	}
+}
+
+static int
+tiff(const uint8_t *p, size_t len, struct exifmeta *m) {
+	struct tiff tf = { .p = p, .len = len };
+	struct dates dt = { 0 };
+
+	if (len < 8)
+		return -1;
+	if (!memcmp(p, "MM\0*", 4))
+		tf.be = true;
+	else if (memcmp(p, "II*\0", 4))
+		return -1;
+	ifd(&tf, u32(&tf, 4), m, &dt, 0);
+	for (int i = 0; i < 3 && !m->date; ++i)
+		m->date = dt.t[i];
+	return 0;
+}
+
+/*
+ * Walk the markers up to the first Exif APP1 and read the IFDs of the
+ * image and of EXIF, nothing more: no MakerNote, thumbnail or GPS.
+ */
+int
+exif_scan(const uint8_t *buf, size_t len, struct exifmeta *m) {
+	size_t p = 2;
+
+	memset(m, 0, sizeof(*m));
+	if (len < 2 || buf[0] != 0xff || buf[1] != 0xd8)
+		return -1;
+	while (p + 4 <= len) {
+		unsigned mk = buf[p + 1];
+		size_t seg;
+
+		if (buf[p] != 0xff)
+			return -1;
+		if (mk == 0xff) {
+			++p;
+			continue;
+		}
+		/* the metadata precedes the scans */
+		if (mk == 0xda || mk == 0xd9)
+			return -1;
+		seg = buf[p + 2] << 8 | buf[p + 3];
+		if (seg < 2)
+			return -1;
+		if (mk == 0xe1 && seg >= 8 && p + 10 <= len && !memcmp(buf + p + 4, "Exif\0", 6)) {
+			size_t n = p + 2 + seg <= len ? seg - 8 : len - p - 10;
+			return tiff(buf + p + 10, n, m);
+		}
+		p += 2 + seg;
+	}
+	return -1;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * What imghash wants from EXIF: the first of DateTimeOriginal,
+ * DateTimeDigitized and DateTime there is, as local time, and the
+ * Orientation. Fields not found are 0.
+ */
+struct exifmeta {
+	time_t date;
+	int orient;
+};
+
+/* returns 0 when there was an EXIF segment */
+int exif_scan(const uint8_t*, size_t, struct exifmeta*);
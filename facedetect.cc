@@ -0,0 +1,147 @@
+/* ============================================================
+ *
+ * This was a part of the face detection of digiKam
+ *
+ * SPDX-FileCopyrightText: 2019 by Thanh Trung Dinh <dinhthanhtrung1996 at gmail dot com>
+ * SPDX-FileCopyrightText: 2020-2022 by Gilles Caulier <caulier dot gilles at gmail dot com>
+ * SPDX-FileCopyrightText: 2023 Lars Lindqvist
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * ============================================================ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <err.h>
+#include <vector>
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/dnn.hpp>
+
+#include "facedetect.h"
+
+static const int SSDSIZ = FACENET_SIZE;
+
+const char facenet_mpath[] = "digikam/facesengine/deploy.prototxt";
+const char facenet_dpath[] = "digikam/facesengine/res10_300x300_ssd_iter_140000_fp16.caffemodel";
+
+struct facenet {
+	cv::dnn::Net net;
+	double confidenceThreshold;
+	double nmsThreshold;
+};
+
+struct facenet *
+facenet_load(const char *mpath, const char *dpath, double score, double nms) {
+	char _dpath[PATH_MAX];
+	char _mpath[PATH_MAX];
+	const char *xdg = getenv("XDG_DATA_HOME");
+
+	snprintf(_dpath, sizeof(_dpath) - 1, "%s/%s", xdg ? xdg : ".", facenet_dpath);
+	snprintf(_mpath, sizeof(_mpath) - 1, "%s/%s", xdg ? xdg : ".", facenet_mpath);
+
+	struct facenet *fn = new facenet;
+	fn->confidenceThreshold = score;
+	fn->nmsThreshold = nms;
+	try {
+		fn->net = cv::dnn::readNetFromCaffe(mpath ? mpath : _mpath, dpath ? dpath : _dpath);
+	} catch (cv::Exception& e) {
+		warnx("%s", e.what());
+		delete fn;
+		return NULL;
+	}
+	return fn;
+}
+
+static int
+detect(struct facenet *fn, const cv::Mat& plane, int img_w, int img_h, struct facebox **out) {
+	double wf = (double)SSDSIZ / img_w;
+	double hf = (double)SSDSIZ / img_h;
+	double scalefactor = wf < hf ? wf : hf;
+	int nw = img_w * scalefactor;
+	int nh = img_h * scalefactor;
+	cv::Mat img;
+	cv::resize(plane, img, cv::Size(nw, nh));
+	int pad_r = SSDSIZ - nw;
+	int pad_b = SSDSIZ - nh;
+	cv::Mat padimg;
+	cv::copyMakeBorder(img, padimg, 0, pad_b, 0, pad_r, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
+
+	if (padimg.empty())
+		return 0;
+
+	fn->net.setInput(
+	 cv::dnn::blobFromImage(padimg, 1.0, cv::Size(SSDSIZ, SSDSIZ), cv::Scalar(104.0, 177.0, 123.0), true, false)
+	);
+	cv::Mat detection = fn->net.forward();
+
+	std::vector<float> confidences;
+	std::vector<cv::Rect> boxes;
+
+	cv::Mat detectionMat(detection.size[2], detection.size[3], CV_32F, detection.ptr<float> ());
+
+	for (int i = 0; i < detectionMat.rows; ++i) {
+		float confidence = detectionMat.at <float>(i, 2);
+
+		if (confidence > fn->confidenceThreshold) {
+			double x = detectionMat.at<float> (i, 3) * SSDSIZ;
+			double w = detectionMat.at<float> (i, 5) * SSDSIZ - x;
+			double y = detectionMat.at<float> (i, 4) * SSDSIZ;
+			double h = detectionMat.at<float> (i, 6) * SSDSIZ - y;
+
+			int bR = SSDSIZ - pad_r;
+			int bB = SSDSIZ - pad_b;
+
+			if ((x     >= cv::min(0.0,                  -0.1 * w)) &&
+			    (x + w <= cv::max(bR + 0.1 * pad_r, bR + 0.1 * w)) &&
+			    (y     >= cv::min(0.0,                  -0.1 * h)) &&
+			    (y + h <= cv::max(bB + 0.1 * pad_b, bB + 0.1 * h))) {
+				boxes.push_back(cv::Rect(x, y, w, h));
+				confidences.push_back(confidence);
+			}
+		}
+	}
+
+	// Perform non maximum suppression to eliminate redundant overlapping boxes with lower confidences
+
+	std::vector<int> indices;
+	cv::dnn::NMSBoxes(boxes, confidences, fn->confidenceThreshold, fn->nmsThreshold, indices);
+
+	// Get detected bounding boxes, in the coordinates of the image
+
+	if (indices.empty())
+		return 0;
+	if (!(*out = (struct facebox *)calloc(indices.size(), sizeof(**out))))
+		err(1, "calloc");
+	for (size_t i = 0; i < indices.size(); ++i) {
+		cv::Rect bbox = boxes[indices[i]];
+		int x = cv::max(0.0, bbox.x / scalefactor);
+		int y = cv::max(0.0, bbox.y / scalefactor);
+
+		(*out)[i].x = x;
+		(*out)[i].y = y;
+		(*out)[i].w = cv::min((double)img_w, bbox.width  / scalefactor + x) - x;
+		(*out)[i].h = cv::min((double)img_h, bbox.height / scalefactor + y) - y;
+	}
+	return indices.size();
+}
+
+int
+facenet_detect(struct facenet *fn, const uint8_t *bgr, int cw, int ch, int w, int h, struct facebox **boxes) {
+	/* OpenCV doesn't write to planes it doesn't own */
+	const cv::Mat plane(ch, cw, CV_8UC3, (void *)bgr);
+
+	*boxes = NULL;
+	try {
+		return detect(fn, plane, w, h, boxes);
+	} catch (cv::Exception& e) {
+		warnx("%s", e.what());
+		return -1;
+	}
+}
+
+void
+facenet_free(struct facenet *fn) {
+	delete fn;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The SSD face detector of digiKam, through OpenCV's dnn module.
+ * A net must not be used by two threads at once.
+ */
+/* images are scaled to fit in this square */
+#define FACENET_SIZE 300
+
+struct facebox {
+	int x, y, w, h;
+};
+
+struct facenet;
+
+extern const char facenet_mpath[];
+extern const char facenet_dpath[];
+
+/* NULL paths are looked up under $XDG_DATA_HOME, or . without it */
+struct facenet *facenet_load(const char *mpath, const char *dpath, double score, double nms);
+/*
+ * Faces of a w x h image, given as a BGR plane of cw x ch. Returns
+ * their number with the boxes in *boxes, to be freed, or -1.
+ */
+int facenet_detect(struct facenet*, const uint8_t *bgr, int cw, int ch, int w, int h, struct facebox **boxes);
+void facenet_free(struct facenet*);
+
+#ifdef __cplusplus
+}
+#endif
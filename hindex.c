@@ -0,0 +1,286 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <err.h>
+
+#include "hindex.h"
+#include "popcnt.h"
+#include "util.h"
+
+#define NOID UINT32_MAX
+
+struct query {
+	const struct hindex *idx;
+	uint64_t q;
+	int maxdist;
+	int radius;
+	int chunk;
+	hindex_cb cb;
+	void *ctx;
+	uint64_t ncmp;
+};
+
+/* bits [c * 64 / nchunks, (c + 1) * 64 / nchunks) of key */
+uint64_t
+hindex_chunk(int nchunks, uint64_t key, int c) {
+	int lo = c * 64 / nchunks;
+	int w = (c + 1) * 64 / nchunks - lo;
+	uint64_t mask = w == 64 ? ~0ULL : (1ULL << w) - 1;
+	return (key >> lo) & mask;
+}
+
+static int
+chunk_width(const struct hindex *idx, int c) {
+	return (c + 1) * 64 / idx->nchunks - c * 64 / idx->nchunks;
+}
+
+static uint64_t
+chunk_val(const struct hindex *idx, uint64_t key, int c) {
+	return hindex_chunk(idx->nchunks, key, c);
+}
+
+static size_t
+slot_of(const struct hindex *idx, int c, uint64_t v) {
+	const struct hindex_tab *tab = &idx->tabs[c];
+	size_t s = (v * 0x9e3779b97f4a7c15ULL) >> 32;
+
+	for (s &= tab->mask; tab->slots[s] != NOID; s = (s + 1) & tab->mask) {
+		if (chunk_val(idx, idx->keys[tab->slots[s]], c) == v)
+			break;
+	}
+	return s;
+}
+
+static void
+tab_grow(struct hindex *idx, int c) {
+	struct hindex_tab *tab = &idx->tabs[c];
+	struct hindex_tab old = *tab;
+
+	tab->mask = old.mask ? 2 * old.mask + 1 : 1023;
+	tab->slots = emalloc((tab->mask + 1) * sizeof(*tab->slots));
+	memset(tab->slots, 0xff, (tab->mask + 1) * sizeof(*tab->slots));
+	for (size_t s = 0; old.slots && s <= old.mask; ++s) {
+		uint32_t id = old.slots[s];
+		if (id != NOID)
+			tab->slots[slot_of(idx, c, chunk_val(idx, idx->keys[id], c))] = id;
+	}
+	free(old.slots);
+}
+
+int
+hindex_nchunks(int maxdist) {
+	if (maxdist < 0)
+		return 1;
+	return maxdist + 1 < HINDEX_MAXCHUNKS ? maxdist + 1 : HINDEX_MAXCHUNKS;
+}
+
+void
+hindex_init(struct hindex *idx, int nchunks) {
+	memset(idx, 0, sizeof(*idx));
+	if (nchunks < 1 || nchunks > HINDEX_MAXCHUNKS)
+		errx(1, "hindex: bad number of chunks %d", nchunks);
+	idx->nchunks = nchunks;
+	for (int c = 0; c < nchunks; ++c)
+		tab_grow(idx, c);
+}
+
+void
+hindex_reserve(struct hindex *idx, size_t n) {
+	if (n <= idx->cap)
+		return;
+	if (n >= NOID)
+		errx(1, "hindex: too many entries %lu", n);
+	idx->cap = n;
+	idx->keys = erealloc(idx->keys, n * sizeof(*idx->keys));
+	for (int c = 0; c < idx->nchunks; ++c)
+		idx->next[c] = erealloc(idx->next[c], n * sizeof(*idx->next[c]));
+}
+
+uint32_t
+hindex_add(struct hindex *idx, uint64_t key) {
+	uint32_t id;
+
+	if (idx->n == idx->cap)
+		hindex_reserve(idx, idx->cap ? 2 * idx->cap : 1024);
+
+	id = idx->n++;
+	idx->keys[id] = key;
+	for (int c = 0; c < idx->nchunks; ++c) {
+		struct hindex_tab *tab = &idx->tabs[c];
+		size_t s;
+
+		if (2 * (tab->used + 1) > tab->mask + 1)
+			tab_grow(idx, c);
+		s = slot_of(idx, c, chunk_val(idx, key, c));
+		if (tab->slots[s] == NOID)
+			++tab->used;
+		idx->next[c][id] = tab->slots[s];
+		tab->slots[s] = id;
+	}
+	return id;
+}
+
+static int
+probe(struct query *qp, uint64_t v) {
+	const struct hindex *idx = qp->idx;
+	uint32_t id = idx->tabs[qp->chunk].slots[slot_of(idx, qp->chunk, v)];
+
+	for (; id != NOID; id = idx->next[qp->chunk][id]) {
+		uint64_t key = idx->keys[id];
+		int d = hdist(key, qp->q);
+		bool seen = false;
+
+		qp->ncmp++;
+		if (d > qp->maxdist)
+			continue;
+		/* reported already when probing an earlier chunk */
+		for (int c = 0; c < qp->chunk && !seen; ++c) {
+			seen = hdist(chunk_val(idx, key, c), chunk_val(idx, qp->q, c)) <= qp->radius;
+		}
+		if (!seen && qp->cb(qp->ctx, id, d))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+probe_ball(struct query *qp, uint64_t v, int bit, int left) {
+	if (probe(qp, v))
+		return 1;
+	if (!left)
+		return 0;
+	for (int w = chunk_width(qp->idx, qp->chunk); bit < w; ++bit) {
+		if (probe_ball(qp, v ^ (1ULL << bit), bit + 1, left - 1))
+			return 1;
+	}
+	return 0;
+}
+
+int
+hindex_query(const struct hindex *idx, uint64_t q, int maxdist, hindex_cb cb, void *ctx) {
+	struct query qry = {
+		.idx = idx,
+		.q = q,
+		.maxdist = maxdist,
+		.radius = maxdist / idx->nchunks,
+		.cb = cb,
+		.ctx = ctx,
+	};
+	int ret = 0;
+
+	if (!idx->n || maxdist < 0)
+		return 0;
+	for (qry.chunk = 0; qry.chunk < idx->nchunks && !ret; ++qry.chunk)
+		ret = probe_ball(&qry, chunk_val(idx, q, qry.chunk), 0, qry.radius);
+	hcount_add(qry.ncmp);
+	return ret;
+}
+
+void
+hindex_free(struct hindex *idx) {
+	free(idx->keys);
+	for (int c = 0; c < idx->nchunks; ++c) {
+		free(idx->next[c]);
+		free(idx->tabs[c].slots);
+	}
+	memset(idx, 0, sizeof(*idx));
+}
+
+/*
+ * Dump the index as is, tables included, so reading it back needs no
+ * rehashing. Native byte order; not meant to be moved between hosts.
+ */
+int
+hindex_write(FILE *fp, const struct hindex *idx) {
+	uint64_t hdr[2] = { idx->nchunks, idx->n };
+
+	if (fwrite(hdr, sizeof(hdr), 1, fp) != 1)
+		return -1;
+	if (idx->n && fwrite(idx->keys, sizeof(*idx->keys), idx->n, fp) != idx->n)
+		return -1;
+	for (int c = 0; c < idx->nchunks; ++c) {
+		const struct hindex_tab *tab = &idx->tabs[c];
+		uint64_t thdr[2] = { tab->mask, tab->used };
+
+		if (fwrite(thdr, sizeof(thdr), 1, fp) != 1)
+			return -1;
+		if (fwrite(tab->slots, sizeof(*tab->slots), tab->mask + 1, fp) != tab->mask + 1)
+			return -1;
+		if (idx->n && fwrite(idx->next[c], sizeof(*idx->next[c]), idx->n, fp) != idx->n)
+			return -1;
+	}
+	return 0;
+}
+
+int
+hindex_read(FILE *fp, struct hindex *idx) {
+	uint64_t hdr[2];
+
+	memset(idx, 0, sizeof(*idx));
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1)
+		return -1;
+	if (hdr[0] < 1 || hdr[0] > HINDEX_MAXCHUNKS || hdr[1] >= NOID)
+		return -1;
+	idx->nchunks = hdr[0];
+	hindex_reserve(idx, hdr[1] ? hdr[1] : 1);
+	idx->n = hdr[1];
+	if (idx->n && fread(idx->keys, sizeof(*idx->keys), idx->n, fp) != idx->n)
+		goto bail;
+	for (int c = 0; c < idx->nchunks; ++c) {
+		struct hindex_tab *tab = &idx->tabs[c];
+		uint64_t thdr[2];
+
+		if (fread(thdr, sizeof(thdr), 1, fp) != 1)
+			goto bail;
+		/* sized and filled as hindex_add() leaves a table */
+		if (thdr[0] < 1023 || thdr[0] > 4ULL * NOID || (thdr[0] & (thdr[0] + 1)) || thdr[1] > idx->n ||
+		    2 * thdr[1] > thdr[0] + 1 || (thdr[0] > 1023 && thdr[0] + 1 >= 4 * (thdr[1] + 1)))
+			goto bail;
+		tab->mask = thdr[0];
+		tab->used = thdr[1];
+		tab->slots = emalloc((tab->mask + 1) * sizeof(*tab->slots));
+		if (fread(tab->slots, sizeof(*tab->slots), tab->mask + 1, fp) != tab->mask + 1)
+			goto bail;
+		if (idx->n && fread(idx->next[c], sizeof(*idx->next[c]), idx->n, fp) != idx->n)
+			goto bail;
+
+		/* queries follow the ids unchecked; chains only lead to earlier ones */
+		size_t used = 0;
+		for (size_t s = 0; s <= tab->mask; ++s) {
+			if (tab->slots[s] != NOID && tab->slots[s] >= idx->n)
+				goto bail;
+			used += tab->slots[s] != NOID;
+		}
+		if (used != tab->used)
+			goto bail;
+		for (size_t id = 0; id < idx->n; ++id) {
+			if (idx->next[c][id] != NOID && idx->next[c][id] >= id)
+				goto bail;
+		}
+	}
+	return 0;
+bail:
+	hindex_free(idx);
+	return -1;
+}
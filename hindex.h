@@ -0,0 +1,45 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HINDEX_MAXCHUNKS 4
+
+/*
+ * Multi-index hashing over 64 bit hashes.
+ *
+ * Keys are split into nchunks bit ranges with a table each. Two keys
+ * within d bits of each other differ in at most d / nchunks bits in
+ * at least one chunk, so a query only probes that neighbourhood of
+ * every table and verifies the candidates it finds.
+ *
+ * Entries are numbered in insertion order. Queries may run
+ * concurrently with each other, but not with hindex_add().
+ */
+struct hindex_tab {
+	size_t mask;
+	size_t used;
+	uint32_t *slots;
+};
+
+struct hindex {
+	int nchunks;
+	size_t n;
+	size_t cap;
+	uint64_t *keys;
+	uint32_t *next[HINDEX_MAXCHUNKS];
+	struct hindex_tab tabs[HINDEX_MAXCHUNKS];
+};
+
+/* return non-zero to stop the query */
+typedef int (*hindex_cb)(void *ctx, uint32_t id, int dist);
+
+int hindex_nchunks(int maxdist);
+uint64_t hindex_chunk(int nchunks, uint64_t, int);
+void hindex_init(struct hindex*, int nchunks);
+void hindex_reserve(struct hindex*, size_t);
+uint32_t hindex_add(struct hindex*, uint64_t);
+int hindex_query(const struct hindex*, uint64_t, int maxdist, hindex_cb, void*);
+void hindex_free(struct hindex*);
+int hindex_write(FILE*, const struct hindex*);
+int hindex_read(FILE*, struct hindex*);
@@ -0,0 +1,502 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <err.h>
+
+#include "_optparse.h"
+#include "imgcode.h"
+#include "imgcmp.h"
+#include "phash.h"
+#include "popcnt.h"
+#include "trim.h"
+#include "util.h"
+
+static const char progname[] = "imgbench";
+static int reps = 5;
+static int warmup = 1;
+static int maxmp = 100;
+static long maxhashes = 10000000;
+static long maxitems = 30000;
+static const char *only = NULL;
+static const char *commit = NULL;
+static bool first = true;
+static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+#define NCALLS 100000
+#define IMLIB_MAXMP 10
+
+/*
+ * One benchmark: run() does one repetition over ctx, which is made of
+ * ops operations, bytes of input and pairs of hash comparisons.
+ */
+struct bench {
+	const char *kernel;
+	const char *variant;
+	const char *unit;
+	size_t size;
+	double ops;
+	double bytes;
+	double pairs;
+	void (*run)(void*);
+	void *ctx;
+};
+
+/* xorshift64*, so inputs are the same on every run */
+static uint64_t
+rnd(void) {
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545f4914f6cdd1dULL;
+}
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+dblcmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static bool
+wanted(const char *kernel) {
+	return !only || strstr(kernel, only);
+}
+
+static void
+run(const struct bench *b) {
+	double *t = emalloc(reps * sizeof(*t));
+	double mean = 0.0, var = 0.0, med;
+
+	for (int i = 0; i < warmup; ++i)
+		b->run(b->ctx);
+	for (int i = 0; i < reps; ++i) {
+		double t0 = now();
+		b->run(b->ctx);
+		t[i] = now() - t0;
+		mean += t[i] / reps;
+	}
+	for (int i = 0; i < reps; ++i)
+		var += (t[i] - mean) * (t[i] - mean) / reps;
+	qsort(t, reps, sizeof(*t), dblcmp);
+	med = reps % 2 ? t[reps / 2] : (t[reps / 2 - 1] + t[reps / 2]) / 2;
+
+	printf(first ? "\n" : ",\n");
+	printf("\t\t{\n");
+	printf("\t\t\t\"kernel\":\"%s\",\n", b->kernel);
+	if (b->variant)
+		printf("\t\t\t\"variant\":\"%s\",\n", b->variant);
+	printf("\t\t\t\"size\":%lu,\n", b->size);
+	printf("\t\t\t\"unit\":\"%s\",\n", b->unit);
+	printf("\t\t\t\"ops\":%.0f,\n", b->ops);
+	printf("\t\t\t\"ns_per_op\":{\"min\":%.3f,\"median\":%.3f,\"mean\":%.3f,\"max\":%.3f,\"stddev\":%.3f}",
+	       t[0] * 1e9 / b->ops, med * 1e9 / b->ops, mean * 1e9 / b->ops,
+	       t[reps - 1] * 1e9 / b->ops, sqrt(var) * 1e9 / b->ops);
+	if (b->bytes)
+		printf(",\n\t\t\t\"mb_per_s\":%.3f", b->bytes / med / 1e6);
+	if (b->pairs)
+		printf(",\n\t\t\t\"pairs_per_s\":%.0f", b->pairs / med);
+	printf("\n\t\t}");
+	fflush(stdout);
+	first = false;
+	free(t);
+}
+
+/* 4:3 gray noise of about mp megapixels */
+struct gray {
+	uint8_t *data;
+	int w, h;
+};
+
+static void
+gray_init(struct gray *g, int mp) {
+	size_t n;
+
+	for (g->h = 3; 4 * (size_t)(g->h + 3) * (g->h + 3) / 3 <= mp * 1000000UL; g->h += 3);
+	g->w = 4 * g->h / 3;
+	n = (size_t)g->w * g->h;
+	g->data = emalloc(n);
+	for (size_t i = 0; i < n; i += 8) {
+		uint64_t r = rnd();
+		memcpy(g->data + i, &r, n - i < 8 ? n - i : 8);
+	}
+}
+
+static void
+run_scale_down(void *ctx) {
+	struct gray *g = ctx;
+	double ebe[64];
+
+	scale_down(ebe, g->data, g->w, g->h);
+}
+
+struct blocks {
+	double *ebe;
+	uint64_t (*xform)(double*, const double*);
+	uint64_t sink;
+};
+
+static void
+run_genhash(void *ctx) {
+	struct blocks *b = ctx;
+
+	for (size_t i = 0; i < NCALLS; ++i)
+		b->sink ^= genhash(b->ebe + 64 * (i % 64));
+}
+
+static void
+run_xform(void *ctx) {
+	struct blocks *b = ctx;
+	double tmp[64];
+
+	for (size_t i = 0; i < NCALLS; ++i)
+		b->sink ^= b->xform(tmp, b->ebe + 64 * (i % 64));
+}
+
+struct pnm {
+	uint8_t *buf;
+	size_t len;
+};
+
+static void
+run_imlib(void *ctx) {
+	struct pnm *p = ctx;
+	int w, h;
+
+	free(imlib_grayscale("bench.ppm", p->buf, p->len, &w, &h));
+}
+
+/* flat borders a tenth of each side wide, then noise */
+static void
+framed(struct gray *g) {
+	int bx = g->w / 10, by = g->h / 10;
+
+	for (int y = 0; y < g->h; ++y) {
+		for (int x = 0; x < g->w; ++x) {
+			if (y < by || y >= g->h - by || x < bx || x >= g->w - bx)
+				g->data[(size_t)y * g->w + x] = 16 + (x + y) % 3;
+		}
+	}
+}
+
+static void
+run_findborder(void *ctx) {
+	static const struct trimparm parm = { .threshold = 26, .gradient = 10, .margin = 4 };
+	struct gray *g = ctx;
+	struct borders bd;
+
+	findborders(&parm, g->data, g->w, g->h, &bd);
+}
+
+struct hashes {
+	uint64_t *h;
+	size_t n;
+	uint64_t sink;
+};
+
+static void
+run_hmatch(void *ctx) {
+	struct hashes *hs = ctx;
+	uint64_t ref = hs->h[0] ^ 0x0101;
+
+	for (size_t i = 0; i < hs->n; i += HMATCH_MAX) {
+		size_t n = hs->n - i < HMATCH_MAX ? hs->n - i : HMATCH_MAX;
+		hs->sink ^= hmatch(ref, hs->h + i, n, 4);
+	}
+}
+
+struct group {
+	struct itemset set;
+	int threshold;
+};
+
+static void
+run_group(void *ctx) {
+	struct group *g = ctx;
+
+	itemset_reset(&g->set);
+	itemset_group(&g->set, g->threshold);
+}
+
+/* hashes closed under the transforms, a fifth of them near copies */
+static struct item_t *
+mkitems(struct arena *a, size_t n) {
+	struct item_t *head = NULL;
+	uint64_t *base = emalloc(n * sizeof(*base));
+
+	for (size_t i = 0; i < n; ++i) {
+		struct item_t *item = arena_alloc(a, sizeof(*item));
+
+		base[i] = rnd();
+		if (i && rnd() % 5 == 0) {
+			base[i] = hash_xform(base[rnd() % i], rnd() % TI_LAST);
+			if (rnd() % 2)
+				base[i] ^= 1ULL << (rnd() % 64);
+		}
+		for (enum trans_t t = 0; t < TI_LAST; ++t)
+			item->hashes[t] = hash_xform(base[i], t);
+		item->next = head;
+		head = item;
+	}
+	free(base);
+	return head;
+}
+
+static void
+bench_images(void) {
+	static const int sizes[] = { 1, 10, 100 };
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes) && sizes[s] <= maxmp; ++s) {
+		struct gray g;
+		struct bench b = { .unit = "pixels", .ops = 1, .run = run_scale_down, .ctx = &g };
+
+		gray_init(&g, sizes[s]);
+		b.size = (size_t)g.w * g.h;
+		b.bytes = b.size;
+		if (wanted("scale_down")) {
+			b.kernel = "scale_down";
+			run(&b);
+		}
+		if (wanted("imlib_grayscale") && sizes[s] <= IMLIB_MAXMP) {
+			char hdr[64];
+			int hl = snprintf(hdr, sizeof(hdr), "P6\n%d %d\n255\n", g.w, g.h);
+			struct pnm p = { .len = hl + 3 * b.size };
+			uint8_t *q;
+
+			p.buf = q = emalloc(p.len);
+			memcpy(q, hdr, hl);
+			q += hl;
+			for (size_t i = 0; i < b.size; ++i, q += 3)
+				q[0] = q[1] = q[2] = g.data[i];
+			if ((q = imlib_grayscale("bench.ppm", p.buf, p.len, &hl, &hl))) {
+				free(q);
+				b.kernel = "imlib_grayscale";
+				b.bytes = p.len;
+				b.run = run_imlib;
+				b.ctx = &p;
+				run(&b);
+			} else {
+				warnx("imlib cannot load PPM, skipping imlib_grayscale");
+			}
+			free(p.buf);
+		}
+		if (wanted("findborder")) {
+			framed(&g);
+			b.kernel = "findborder";
+			b.bytes = b.size;
+			b.run = run_findborder;
+			b.ctx = &g;
+			run(&b);
+		}
+		free(g.data);
+	}
+}
+
+static void
+bench_blocks(void) {
+	static const struct {
+		const char *name;
+		uint64_t (*fn)(double*, const double*);
+	} xforms[] = {
+		{ "hflip", hflip }, { "hrot1", hrot1 },
+		{ "hrot2", hrot2 }, { "hrot3", hrot3 },
+	};
+	struct blocks bl = { .ebe = emalloc(64 * 64 * sizeof(*bl.ebe)) };
+	struct bench b = { .unit = "calls", .size = NCALLS, .ops = NCALLS, .ctx = &bl };
+
+	for (size_t i = 0; i < 64 * 64; ++i)
+		bl.ebe[i] = rnd() % 256;
+	if (wanted("genhash")) {
+		b.kernel = "genhash";
+		b.run = run_genhash;
+		run(&b);
+	}
+	for (size_t i = 0; i < sizeof(xforms) / sizeof(*xforms); ++i) {
+		if (!wanted(xforms[i].name))
+			continue;
+		b.kernel = xforms[i].name;
+		b.run = run_xform;
+		bl.xform = xforms[i].fn;
+		run(&b);
+	}
+	free(bl.ebe);
+}
+
+static void
+bench_hashes(void) {
+	static const char *kernels[] = { "scalar", "popcnt", "avx2", "avx512" };
+	const char *dflt = popcnt_name();
+
+	if (!wanted("hmatch"))
+		return;
+	for (long n = 10000; n <= maxhashes; n *= 10) {
+		struct hashes hs = { .n = n, .h = emalloc(n * sizeof(*hs.h)) };
+		struct bench b = {
+			.kernel = "hmatch",
+			.unit = "hashes",
+			.size = n,
+			.ops = n,
+			.bytes = n * sizeof(*hs.h),
+			.pairs = n,
+			.run = run_hmatch,
+			.ctx = &hs,
+		};
+
+		for (long i = 0; i < n; ++i)
+			hs.h[i] = rnd();
+		for (size_t k = 0; k < sizeof(kernels) / sizeof(*kernels); ++k) {
+			if (popcnt_use(kernels[k]) < 0)
+				continue;
+			b.variant = kernels[k];
+			run(&b);
+		}
+		free(hs.h);
+	}
+	popcnt_use(dflt);
+}
+
+static void
+bench_group(void) {
+	static const long sizes[] = { 1000, 10000, 30000, 100000 };
+	static const struct {
+		const char *variant;
+		int threshold;
+	} modes[] = {
+		{ "exact", 0 }, { "l4", 4 },
+	};
+
+	if (!wanted("intracmp"))
+		return;
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes) && sizes[s] <= maxitems; ++s) {
+		struct arena a = { 0 };
+		struct group g;
+		struct bench b = {
+			.kernel = "intracmp",
+			.unit = "items",
+			.size = sizes[s],
+			.ops = sizes[s] * (sizes[s] - 1) / 2,
+			.pairs = sizes[s] * (sizes[s] - 1) / 2,
+			.run = run_group,
+			.ctx = &g,
+		};
+
+		itemset_init(&g.set, mkitems(&a, sizes[s]));
+		for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); ++m) {
+			b.variant = modes[m].variant;
+			g.threshold = modes[m].threshold;
+			run(&b);
+		}
+		itemset_free(&g.set);
+		arena_free(&a);
+	}
+}
+
+static const struct optparse_long longopts[] = {
+	{ "repetitions",    'r', OPTPARSE_REQUIRED },
+	{ "warmup",         'w', OPTPARSE_REQUIRED },
+	{ "megapixels",     'm', OPTPARSE_REQUIRED },
+	{ "hashes",         'n', OPTPARSE_REQUIRED },
+	{ "items",          'N', OPTPARSE_REQUIRED },
+	{ "kernel",         'k', OPTPARSE_REQUIRED },
+	{ "commit",         'c', OPTPARSE_REQUIRED },
+	{ "quick",          'Q', OPTPARSE_NONE },
+	{ 0 },
+};
+
+static void
+usage(void) {
+	printf("usage: %s [opts]\n", progname);
+	optparse_dump_options(longopts);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct optparse op;
+	long opt;
+
+	optparse_init(&op, argv);
+	while ((opt = optparse_long(&op, longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'r':
+			if ((reps = atoi(op.optarg)) < 1)
+				usage();
+			break;
+		case 'w':
+			warmup = atoi(op.optarg);
+			break;
+		case 'm':
+			maxmp = atoi(op.optarg);
+			break;
+		case 'n':
+			maxhashes = atol(op.optarg);
+			break;
+		case 'N':
+			maxitems = atol(op.optarg);
+			break;
+		case 'k':
+			only = op.optarg;
+			break;
+		case 'c':
+			commit = op.optarg;
+			break;
+		case 'Q':
+			maxmp = 10;
+			maxhashes = 1000000;
+			maxitems = 10000;
+			break;
+		case '?':
+			warnx("%s", op.errmsg);
+			usage();
+			break;
+		}
+	}
+	if (op.optind < argc)
+		usage();
+
+	printf("{\n");
+	if (commit && *commit)
+		printf("\t\"commit\":\"%s\",\n", commit);
+	printf("\t\"popcnt\":\"%s\",\n", popcnt_name());
+	printf("\t\"repetitions\":%d,\n", reps);
+	printf("\t\"warmup\":%d,\n", warmup);
+	printf("\t\"results\":[");
+	bench_images();
+	bench_blocks();
+	bench_hashes();
+	bench_group();
+	printf("\n\t]\n}\n");
+	return 0;
+}
@@ -21,6 +21,12 @@
  */
 
 #include "imgcmp.h"
+#include "popcnt.h"
+
+const enum trans_t cmp_order[TI_LAST] = {
+	TI_BASE, TI_FLIP, TI_ROT1, TI_ROT2,
+	TI_ROT3, TI_FLR1, TI_FLR2, TI_FLR3,
+};
 
 const char *
 tname(enum trans_t t) {
@@ -38,35 +44,32 @@ tname(enum trans_t t) {
 	}
 }
 
-struct item_t *
-free_item(struct item_t *item) {
-	if (!item)
-		return NULL;
-	struct item_t *next = item->next;
-	free(item->path);
-	free(item->data);
-	free(item);
-	return next;
-}
-
-void
-free_items(struct item_t *items) {
-	while (items) {
-		items = free_item(items);
-	}
-}
-
 void
 fputjson(FILE *fp, const char *indent, const struct item_t *item, bool first) {
 	fprintf(fp, first ? "\n" : ",\n");
 	fprintf(fp, "%s{\n", indent);
 	fprintf(fp, "%s\t\"path\":\"%s\",\n", indent, item->path);
+	if (item->exact)
+		fprintf(fp, "%s\t\"exact\":\"%s\",\n", indent, item->exact);
 	fprintf(fp, "%s\t\"size\":%d,\n", indent, item->size);
 	fprintf(fp, "%s\t\"w\":%d,\n", indent, item->w);
 	fprintf(fp, "%s\t\"h\":%d,\n", indent, item->h);
 	fprintf(fp, "%s\t\"mtime\":%ld,\n", indent, item->mtime);
 	if (item->etime)
 		fprintf(fp, "%s\t\"etime\":%ld,\n", indent, item->etime);
+	if (item->orient)
+		fprintf(fp, "%s\t\"orient\":%d,\n", indent, item->orient);
+	if (item->crop[2])
+		fprintf(fp, "%s\t\"crop\":[%d,%d,%d,%d],\n", indent,
+		       item->crop[0], item->crop[1], item->crop[2], item->crop[3]);
+	if (item->nfaces > 0) {
+		fprintf(fp, "%s\t\"faces\":[", indent);
+		for (int i = 0; i < item->nfaces; ++i) {
+			const int *f = item->faces + 4 * i;
+			fprintf(fp, "%s[%d,%d,%d,%d]", i ? "," : "", f[0], f[1], f[2], f[3]);
+		}
+		fprintf(fp, "],\n");
+	}
 	if (item->eq_dist != -1) {
 		fprintf(fp, "%s\t\"dist\":%d,\n", indent, item->eq_dist);
 		fprintf(fp, "%s\t\"xform\":\"%s\",\n", indent, tname(item->eq_trans));
@@ -82,3 +85,441 @@ fputjson(FILE *fp, const char *indent, const struct item_t *item, bool first) {
 	}
 	fprintf(fp, "%s}", indent);
 }
+
+void
+itemset_init(struct itemset *set, struct item_t *items) {
+	struct item_t *item;
+	size_t n = 0;
+	uint64_t *hashes;
+
+	for (item = items; item; item = item->next)
+		++n;
+	if (n >= NOIDX)
+		errx(1, "too many items: %lu", n);
+
+	set->n = n;
+	hashes = emalloc(n * TI_LAST * sizeof(*hashes));
+	for (size_t t = 0; t < TI_LAST; ++t)
+		set->hashes[t] = hashes + t * n;
+	set->items = emalloc(n * sizeof(*set->items));
+	set->eq_parent = emalloc(n * sizeof(*set->eq_parent));
+	set->eq_next = emalloc(n * sizeof(*set->eq_next));
+	set->eq_n = emalloc(n * sizeof(*set->eq_n));
+	set->eq_trans = emalloc(n * sizeof(*set->eq_trans));
+
+	for (n = 0, item = items; item; item = item->next, ++n) {
+		for (size_t t = 0; t < TI_LAST; ++t)
+			set->hashes[t][n] = item->hashes[t];
+		set->items[n] = item;
+	}
+	itemset_reset(set);
+}
+
+void
+itemset_reset(struct itemset *set) {
+	for (size_t i = 0; i < set->n; ++i) {
+		set->eq_parent[i] = NOIDX;
+		set->eq_next[i] = NOIDX;
+		set->eq_n[i] = 0;
+		set->eq_trans[i] = TI_LAST;
+	}
+}
+
+void
+itemset_free(struct itemset *set) {
+	free(set->hashes[TI_BASE]);
+	free(set->items);
+	free(set->eq_parent);
+	free(set->eq_next);
+	free(set->eq_n);
+	free(set->eq_trans);
+	memset(set, 0, sizeof(*set));
+}
+
+/*
+ * Exact matches are one orbit lookup per item. The claims are those
+ * of the pairwise loop below and are linked in its order too: by the
+ * claiming item, then by the claimed one.
+ */
+static void
+group_exact(struct itemset *set) {
+	uint32_t *claim = emalloc(set->n * sizeof(*claim) + 1);
+	uint32_t *first = emalloc(set->n * sizeof(*first) + 1);
+	uint32_t *next = emalloc(set->n * sizeof(*next) + 1);
+	struct matchidx mi;
+
+	matchidx_init(&mi, 0);
+	for (uint32_t i = 0; i < set->n; ++i) {
+		uint64_t hashes[TI_LAST];
+		enum trans_t t;
+
+		for (t = 0; t < TI_LAST; ++t)
+			hashes[t] = set->hashes[t][i];
+		claim[i] = matchidx_find(&mi, hashes, &t);
+		if (claim[i] != NOIDX)
+			set->eq_trans[i] = t;
+		matchidx_add(&mi, hashes);
+		first[i] = NOIDX;
+	}
+	matchidx_free(&mi);
+
+	for (uint32_t i = set->n; i-- > 0;) {
+		if (claim[i] != NOIDX) {
+			next[i] = first[claim[i]];
+			first[claim[i]] = i;
+		}
+	}
+	for (uint32_t ref = 0; ref < set->n; ++ref) {
+		for (uint32_t tmp = first[ref]; tmp != NOIDX; tmp = next[tmp]) {
+			uint32_t p;
+			for (p = ref; set->eq_parent[p] != NOIDX; p = set->eq_parent[p]);
+			set->eq_parent[tmp] = p;
+			set->eq_next[tmp] = set->eq_next[p];
+			set->eq_next[p] = tmp;
+			set->eq_n[p]++;
+		}
+	}
+	free(claim);
+	free(first);
+	free(next);
+}
+
+/*
+ * Every item goes to the first earlier item it matches. Later items
+ * are tested against an item's base hash a block and a transform at
+ * a time, then claimed in item order.
+ */
+void
+itemset_group(struct itemset *set, int threshold) {
+	if (!threshold) {
+		group_exact(set);
+		return;
+	}
+	for (uint32_t ref = 0; ref < set->n; ++ref) {
+		uint64_t base = set->hashes[TI_BASE][ref];
+		uint32_t p;
+
+		for (p = ref; set->eq_parent[p] != NOIDX; p = set->eq_parent[p]);
+		hcount_add((uint64_t)(set->n - ref - 1) * TI_LAST);
+		for (uint32_t blk = ref + 1; blk < set->n; blk += HMATCH_MAX) {
+			size_t n = set->n - blk < HMATCH_MAX ? set->n - blk : HMATCH_MAX;
+			uint64_t m[TI_LAST], any = 0;
+
+			for (size_t k = 0; k < TI_LAST; ++k)
+				any |= m[k] = hmatch(base, set->hashes[cmp_order[k]] + blk, n, threshold);
+			for (; any; any &= any - 1) {
+				int b = __builtin_ctzll(any);
+				uint32_t tmp = blk + b;
+				size_t k;
+
+				if (set->eq_parent[tmp] != NOIDX)
+					continue;
+				for (k = 0; !(m[k] >> b & 1); ++k);
+				set->eq_parent[tmp] = p;
+				set->eq_next[tmp] = set->eq_next[p];
+				set->eq_trans[tmp] = cmp_order[k];
+				set->eq_next[p] = tmp;
+				set->eq_n[p]++;
+			}
+		}
+	}
+}
+
+void
+dedup_init(struct dedup *dd, int threshold) {
+	memset(dd, 0, sizeof(*dd));
+	dd->threshold = threshold;
+	matchidx_init(&dd->idx, threshold);
+}
+
+/* bit 8 * r + c of a hash is the sign of DCT coefficient (r, c) */
+#define ODD_COLS 0xaaaaaaaaaaaaaaaaULL
+#define ODD_ROWS 0xff00ff00ff00ff00ULL
+
+static uint64_t
+transpose(uint64_t x) {
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x ^= t ^ (t << 28);
+	return x;
+}
+
+/*
+ * Hash of transform t of the image with base hash h. Flipping negates
+ * the odd columns of the DCT, flipping upside down the odd rows, and
+ * mirroring on the diagonal transposes it. Exact except for
+ * coefficients that are zero, which hash to 0 either way.
+ */
+uint64_t
+hash_xform(uint64_t h, enum trans_t t) {
+	switch (t) {
+	case TI_BASE: return h;
+	case TI_FLIP: return h ^ ODD_COLS;
+	case TI_FLR2: return h ^ ODD_ROWS;
+	case TI_ROT2: return h ^ ODD_COLS ^ ODD_ROWS;
+	case TI_FLR3: return transpose(h);
+	case TI_ROT1: return transpose(h) ^ ODD_COLS;
+	case TI_ROT3: return transpose(h) ^ ODD_ROWS;
+	case TI_FLR1: return transpose(h) ^ ODD_COLS ^ ODD_ROWS;
+	default:
+		return h;
+	}
+}
+
+/*
+ * The smallest of an item's hashes and the transform it came from,
+ * the first in cmp_order on ties. Items whose hashes are all
+ * transforms of one another have the same one.
+ */
+uint64_t
+canon_hash(const uint64_t *hashes, enum trans_t *trans) {
+	enum trans_t bt = TI_BASE;
+
+	for (size_t k = 1; k < TI_LAST; ++k) {
+		if (hashes[cmp_order[k]] < hashes[bt])
+			bt = cmp_order[k];
+	}
+	if (trans)
+		*trans = bt;
+	return hashes[bt];
+}
+
+/* whether the stored transforms are the ones hash_xform() predicts */
+bool
+hashes_closed(const uint64_t *hashes) {
+	for (enum trans_t t = 1; t < TI_LAST; ++t) {
+		if (hashes[t] != hash_xform(hashes[TI_BASE], t))
+			return false;
+	}
+	return true;
+}
+
+static uint64_t
+orbit_min(uint64_t h) {
+	uint64_t hashes[TI_LAST];
+
+	for (enum trans_t t = 0; t < TI_LAST; ++t)
+		hashes[t] = hash_xform(h, t);
+	return canon_hash(hashes, NULL);
+}
+
+static int
+min_id(void *ctx, uint32_t id, int dist) {
+	uint32_t *best = ctx;
+	if (id < *best)
+		*best = id;
+	return 0;
+}
+
+static uint32_t
+earliest_match(const struct hindex *idx, const uint64_t *hashes, int threshold, enum trans_t *trans) {
+	uint32_t best = NOIDX;
+
+	*trans = TI_LAST;
+	for (size_t k = 0; k < TI_LAST; ++k) {
+		uint32_t found = best;
+		hindex_query(idx, hashes[cmp_order[k]], threshold, min_id, &found);
+		if (found < best) {
+			best = found;
+			*trans = cmp_order[k];
+		}
+	}
+	return best;
+}
+
+void
+matchidx_init(struct matchidx *mi, int threshold) {
+	memset(mi, 0, sizeof(*mi));
+	mi->threshold = threshold;
+	hindex_init(&mi->idx, hindex_nchunks(threshold));
+}
+
+uint32_t
+matchidx_add(struct matchidx *mi, const uint64_t *hashes) {
+	size_t cap = mi->idx.cap;
+	bool canon = !mi->threshold && hashes_closed(hashes);
+	uint32_t id;
+
+	id = hindex_add(&mi->idx, canon ? orbit_min(hashes[TI_BASE]) : hashes[TI_BASE]);
+	if (mi->idx.cap != cap)
+		mi->base = erealloc(mi->base, mi->idx.cap * sizeof(*mi->base));
+	mi->base[id] = hashes[TI_BASE];
+	if (!canon)
+		mi->nloose++;
+	return id;
+}
+
+struct exact {
+	const struct matchidx *mi;
+	const uint64_t *hashes;
+	uint32_t best;
+};
+
+/* keys only pick candidates, a match is a base equal to some transform */
+static int
+exact_id(void *ctx, uint32_t id, int dist) {
+	struct exact *ex = ctx;
+
+	if (id >= ex->best)
+		return 0;
+	for (enum trans_t t = 0; t < TI_LAST; ++t) {
+		if (ex->hashes[t] == ex->mi->base[id]) {
+			ex->best = id;
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Earliest entry within threshold of any of an item's hashes, trying
+ * transforms in cmp_order. The transform that matched it is stored in
+ * *trans.
+ */
+uint32_t
+matchidx_find(const struct matchidx *mi, const uint64_t *hashes, enum trans_t *trans) {
+	struct exact ex = { .mi = mi, .hashes = hashes, .best = NOIDX };
+
+	if (mi->threshold)
+		return earliest_match(&mi->idx, hashes, mi->threshold, trans);
+
+	if (hashes_closed(hashes)) {
+		hindex_query(&mi->idx, orbit_min(hashes[TI_BASE]), 0, exact_id, &ex);
+	} else for (enum trans_t t = 0; t < TI_LAST; ++t) {
+		hindex_query(&mi->idx, orbit_min(hashes[t]), 0, exact_id, &ex);
+	}
+	if (mi->nloose) {
+		for (enum trans_t t = 0; t < TI_LAST; ++t)
+			hindex_query(&mi->idx, hashes[t], 0, exact_id, &ex);
+	}
+
+	*trans = TI_LAST;
+	for (size_t k = 0; ex.best != NOIDX && *trans == TI_LAST; ++k) {
+		if (hashes[cmp_order[k]] == mi->base[ex.best])
+			*trans = cmp_order[k];
+	}
+	return ex.best;
+}
+
+void
+matchidx_free(struct matchidx *mi) {
+	hindex_free(&mi->idx);
+	free(mi->base);
+	memset(mi, 0, sizeof(*mi));
+}
+
+int
+matchidx_write(FILE *fp, const struct matchidx *mi) {
+	int64_t hdr[2] = { mi->threshold, mi->nloose };
+
+	if (fwrite(hdr, sizeof(hdr), 1, fp) != 1 || hindex_write(fp, &mi->idx) < 0)
+		return -1;
+	if (mi->idx.n && fwrite(mi->base, sizeof(*mi->base), mi->idx.n, fp) != mi->idx.n)
+		return -1;
+	return 0;
+}
+
+int
+matchidx_read(FILE *fp, struct matchidx *mi) {
+	int64_t hdr[2];
+
+	memset(mi, 0, sizeof(*mi));
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1 || hindex_read(fp, &mi->idx) < 0)
+		return -1;
+	if (hdr[0] < 0 || hdr[0] > 64 || hindex_nchunks(hdr[0]) != mi->idx.nchunks ||
+	    hdr[1] < 0 || (uint64_t)hdr[1] > mi->idx.n) {
+		matchidx_free(mi);
+		return -1;
+	}
+	mi->threshold = hdr[0];
+	mi->nloose = hdr[1];
+	mi->base = emalloc(mi->idx.cap * sizeof(*mi->base));
+	if (mi->idx.n && fread(mi->base, sizeof(*mi->base), mi->idx.n, fp) != mi->idx.n) {
+		matchidx_free(mi);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Returns the id of the added item and stores the id of the earliest
+ * match, or NOIDX, in *match. The group head is dd->parent[id].
+ */
+uint32_t
+dedup_add(struct dedup *dd, struct item_t *item, uint32_t *match) {
+	enum trans_t bt;
+	uint32_t best;
+	uint32_t id;
+
+	best = matchidx_find(&dd->idx, item->hashes, &bt);
+	id = matchidx_add(&dd->idx, item->hashes);
+	dd->n = id + 1;
+	if (id == dd->cap) {
+		dd->cap = dd->cap ? 2 * dd->cap : 1024;
+		dd->items = erealloc(dd->items, dd->cap * sizeof(*dd->items));
+		dd->parent = erealloc(dd->parent, dd->cap * sizeof(*dd->parent));
+		dd->trans = erealloc(dd->trans, dd->cap * sizeof(*dd->trans));
+	}
+	dd->items[id] = item;
+	dd->trans[id] = bt;
+	if (best == NOIDX)
+		dd->parent[id] = NOIDX;
+	else
+		dd->parent[id] = dd->parent[best] == NOIDX ? best : dd->parent[best];
+	if (match)
+		*match = best;
+	return id;
+}
+
+void
+dedup_free(struct dedup *dd) {
+	matchidx_free(&dd->idx);
+	free(dd->items);
+	free(dd->parent);
+	free(dd->trans);
+	memset(dd, 0, sizeof(*dd));
+}
+
+/* groups in the JSON shape of imgdups -a, in order of their heads */
+void
+dedup_fputjson(FILE *fp, const struct dedup *dd) {
+	size_t n = dd->n;
+	uint32_t *next = emalloc(n * sizeof(*next) + 1);
+	bool first = true;
+
+	for (size_t i = 0; i < n; ++i)
+		next[i] = NOIDX;
+	/* a head precedes its members, so its own slot can start the list */
+	for (size_t i = n; i-- > 0;) {
+		uint32_t p = dd->parent[i];
+		if (p != NOIDX) {
+			next[i] = next[p];
+			next[p] = i;
+		}
+	}
+
+	fprintf(fp, "[");
+	for (size_t r = 0; r < n; ++r) {
+		const struct item_t *ref = dd->items[r];
+
+		if (dd->parent[r] != NOIDX || next[r] == NOIDX)
+			continue;
+		fprintf(fp, first ? "\t[" : ",[");
+		fputjson(fp, "\t\t", ref, true);
+		for (uint32_t i = next[r]; i != NOIDX; i = next[i]) {
+			struct item_t tmp = *dd->items[i];
+			tmp.eq_trans = dd->trans[i];
+			tmp.eq_dist = hdist(ref->hashes[TI_BASE], tmp.hashes[tmp.eq_trans]);
+			fputjson(fp, "\t\t", &tmp, false);
+		}
+		fprintf(fp, "\n\t]");
+		first = false;
+	}
+	fprintf(fp, "\n]\n");
+	free(next);
+}
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <err.h>
 
+#include "hindex.h"
+
 enum trans_t {
 	TI_BASE, TI_ROT1, TI_ROT2, TI_ROT3,
 	TI_FLIP, TI_FLR1, TI_FLR2, TI_FLR3, TI_LAST,
@@ -23,20 +25,93 @@ struct item_t {
 	uint8_t *data;
 	time_t mtime;
 	time_t etime;
+	int orient;	/* EXIF Orientation, 0 without */
 	int w, h, size;
+	int crop[4];	/* x, y, w, h; w is 0 without a border */
+	int nfaces;
+	int *faces;	/* x, y, w, h of each face */
+	char *exact;	/* path of the file this is a byte for byte copy of */
+	struct item_t *copies;
 	uint64_t hashes[TI_LAST];
 	struct item_t *next;
-	struct item_t *eq_parent;
-	struct item_t *eq_next;
 	enum trans_t eq_trans;
 	int eq_dist;
-	int eq_n;
 };
 
+#define NOIDX UINT32_MAX
+
+/*
+ * Structure-of-arrays copy of an item list, in list order, for the
+ * comparison loops. Each transform's hashes are contiguous so a scan
+ * only streams the words it compares. Group links are indices: a
+ * member's eq_parent and a group head's eq_next refer to the set the
+ * comparison was made against, which may be another itemset.
+ */
+struct itemset {
+	size_t n;
+	uint64_t *hashes[TI_LAST];
+	struct item_t **items;
+	uint32_t *eq_parent;
+	uint32_t *eq_next;
+	uint32_t *eq_n;
+	uint8_t *eq_trans;
+};
+
+/*
+ * Index to find the earliest added item whose base hash is within
+ * threshold of any of a new item's transforms.
+ *
+ * With a threshold of 0 that is one orbit lookup: the transforms only
+ * permute and negate DCT coefficients, so their hashes follow from the
+ * base hash, and two items match exactly when their canonical hashes
+ * are equal. Such items get one key and one probe. Items whose stored
+ * hashes disagree with that, usually from coefficients that are zero,
+ * are keyed by their base hash instead and found the exact way.
+ */
+struct matchidx {
+	int threshold;
+	size_t nloose;
+	uint64_t *base;
+	struct hindex idx;
+};
+
+/*
+ * Online grouping. An added item joins the group of the earliest
+ * added item whose base hash is within threshold of any of its
+ * transforms, the rule imgdups applies to a whole list at once.
+ * Not thread safe.
+ */
+struct dedup {
+	int threshold;
+	size_t n;
+	struct matchidx idx;
+	size_t cap;
+	struct item_t **items;
+	uint32_t *parent;
+	uint8_t *trans;
+};
+
+extern const enum trans_t cmp_order[TI_LAST];
+
 const char *tname(enum trans_t);
-struct item_t *free_item(struct item_t*);
 void *ecalloc(size_t, size_t);
 void *emalloc(size_t);
 void *erealloc(void*, size_t);
 void fputjson(FILE*, const char*, const struct item_t*, bool);
-void free_items(struct item_t*);
+void itemset_init(struct itemset*, struct item_t*);
+void itemset_reset(struct itemset*);
+void itemset_free(struct itemset*);
+void itemset_group(struct itemset*, int);
+uint64_t hash_xform(uint64_t, enum trans_t);
+uint64_t canon_hash(const uint64_t*, enum trans_t*);
+bool hashes_closed(const uint64_t*);
+void matchidx_init(struct matchidx*, int);
+uint32_t matchidx_add(struct matchidx*, const uint64_t*);
+uint32_t matchidx_find(const struct matchidx*, const uint64_t*, enum trans_t*);
+void matchidx_free(struct matchidx*);
+int matchidx_write(FILE*, const struct matchidx*);
+int matchidx_read(FILE*, struct matchidx*);
+void dedup_init(struct dedup*, int);
+uint32_t dedup_add(struct dedup*, struct item_t*, uint32_t*);
+void dedup_free(struct dedup*);
+void dedup_fputjson(FILE*, const struct dedup*);
@@ -0,0 +1,760 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include <Imlib2.h>
+#include <turbojpeg.h>
+
+#include "_optparse.h"
+#include "util.h"
+
+static const char progname[] = "imgcorpus";
+static int verbose = 1;
+static int ncorpus = 200;
+static uint64_t seed = 1;
+static const char *bindir = ".";
+static const char *threadlist = "1,2,4,8";
+static int threshold = 2;
+static int tolerance = 3;
+
+#define JPGTRIM_MARGIN 4
+
+/*
+ * Corpus generation. Every original is painted from the seed alone,
+ * so a corpus can be regenerated bit for bit. The manifest lists
+ * each file with the group of the original it was derived from, how
+ * it was derived and, for bordered scans, the planted border widths.
+ */
+struct img {
+	uint8_t *rgb;
+	int w, h;
+};
+
+static const struct {
+	int w, h;
+} sizes[] = {
+	{ 640, 480 }, { 1024, 768 }, { 1600, 1200 }, { 480, 640 },
+	{ 800, 800 }, { 2048, 1536 }, { 3000, 2000 }, { 1200, 1600 },
+};
+
+enum variant {
+	V_ROT90, V_ROT180, V_ROT270, V_FLIP, V_TRANSPOSE,
+	V_HALF, V_REQUAL, V_LAST,
+};
+
+static const char *vname[V_LAST] = {
+	"rot90", "rot180", "rot270", "flip", "transpose", "half", "requal",
+};
+
+static uint64_t
+rnd(void) {
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545f4914f6cdd1dULL;
+}
+
+/* in [lo, hi] */
+static int
+rndint(int lo, int hi) {
+	return lo + rnd() % (hi - lo + 1);
+}
+
+static uint8_t
+clamp(double v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static void
+img_alloc(struct img *im, int w, int h) {
+	im->w = w;
+	im->h = h;
+	im->rgb = emalloc((size_t)w * h * 3);
+}
+
+/*
+ * Something with the statistics of a photo: a gradient, a few
+ * separable waves over some blobs, and enough sensor noise that
+ * no row or column of content looks like a flat border to jpgtrim.
+ */
+static void
+paint(struct img *im, int w, int h) {
+	double *wx = emalloc(w * 3 * sizeof(*wx));
+	double *wy = emalloc(h * 3 * sizeof(*wy));
+	double c0[3], c1[3];
+	bool horiz = rnd() % 2;
+
+	img_alloc(im, w, h);
+	for (int c = 0; c < 3; ++c) {
+		double fx = rndint(10, 40) / 1000.0, px = rndint(0, 628) / 100.0;
+		double fy = rndint(10, 40) / 1000.0, py = rndint(0, 628) / 100.0;
+		double ax = rndint(15, 30), ay = rndint(15, 30);
+
+		c0[c] = rndint(60, 195);
+		c1[c] = rndint(60, 195);
+		for (int x = 0; x < w; ++x)
+			wx[3 * x + c] = ax * sin(fx * x + px);
+		for (int y = 0; y < h; ++y)
+			wy[3 * y + c] = ay * sin(fy * y + py);
+	}
+	for (int y = 0; y < h; ++y) {
+		uint8_t *p = im->rgb + (size_t)y * w * 3;
+		for (int x = 0; x < w; ++x) {
+			double f = horiz ? (double)x / w : (double)y / h;
+			for (int c = 0; c < 3; ++c)
+				*p++ = c0[c] + f * (c1[c] - c0[c]);
+		}
+	}
+	for (int n = rndint(5, 15); n > 0; --n) {
+		int cx = rndint(0, w - 1), cy = rndint(0, h - 1);
+		int rx = rndint(w / 40 + 1, w / 4), ry = rndint(h / 40 + 1, h / 4);
+		uint8_t col[3] = { rndint(60, 195), rndint(60, 195), rndint(60, 195) };
+
+		for (int y = cy - ry < 0 ? 0 : cy - ry; y < h && y <= cy + ry; ++y) {
+			for (int x = cx - rx < 0 ? 0 : cx - rx; x < w && x <= cx + rx; ++x) {
+				double dx = (double)(x - cx) / rx, dy = (double)(y - cy) / ry;
+				if (dx * dx + dy * dy <= 1.0)
+					memcpy(im->rgb + ((size_t)y * w + x) * 3, col, 3);
+			}
+		}
+	}
+	for (int y = 0; y < h; ++y) {
+		uint8_t *p = im->rgb + (size_t)y * w * 3;
+		for (int x = 0; x < w; ++x) {
+			for (int c = 0; c < 3; ++c, ++p)
+				*p = clamp(*p + wx[3 * x + c] + wy[3 * y + c] + (int)(rnd() % 17) - 8);
+		}
+	}
+	free(wx);
+	free(wy);
+}
+
+static void
+derive(struct img *dst, const struct img *src, enum variant v) {
+	int w = src->w, h = src->h;
+	bool swap = v == V_ROT90 || v == V_ROT270 || v == V_TRANSPOSE;
+
+	/* averaging smooths the noise away, so put some back */
+	if (v == V_HALF) {
+		img_alloc(dst, w / 2, h / 2);
+		for (int y = 0; y < h / 2; ++y)
+		for (int x = 0; x < w / 2; ++x)
+		for (int c = 0; c < 3; ++c) {
+			const uint8_t *s = src->rgb + ((size_t)2 * y * w + 2 * x) * 3 + c;
+			int avg = (s[0] + s[3] + s[3 * w] + s[3 * w + 3] + 2) / 4;
+			dst->rgb[((size_t)y * (w / 2) + x) * 3 + c] = clamp(avg + (int)(rnd() % 13) - 6);
+		}
+		return;
+	}
+	if (v == V_REQUAL) {
+		img_alloc(dst, w, h);
+		for (size_t i = 0; i < (size_t)w * h * 3; ++i)
+			dst->rgb[i] = clamp(src->rgb[i] + 4);
+		return;
+	}
+
+	img_alloc(dst, swap ? h : w, swap ? w : h);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			int dx = x, dy = y;
+			switch (v) {
+			case V_ROT90:     dx = h - 1 - y; dy = x;         break;
+			case V_ROT180:    dx = w - 1 - x; dy = h - 1 - y; break;
+			case V_ROT270:    dx = y;         dy = w - 1 - x; break;
+			case V_FLIP:      dx = w - 1 - x;                 break;
+			case V_TRANSPOSE: dx = y;         dy = x;         break;
+			default:
+				break;
+			}
+			memcpy(dst->rgb + ((size_t)dy * dst->w + dx) * 3, src->rgb + ((size_t)y * w + x) * 3, 3);
+		}
+	}
+}
+
+/* a scan on a flat, faintly noisy background */
+static void
+frame(struct img *dst, const struct img *src, const int bd[4]) {
+	uint8_t bg = rnd() % 2 ? rndint(235, 250) : rndint(5, 20);
+
+	img_alloc(dst, src->w + bd[0] + bd[2], src->h + bd[1] + bd[3]);
+	for (size_t i = 0; i < (size_t)dst->w * dst->h * 3; ++i)
+		dst->rgb[i] = bg + rnd() % 2;
+	for (int y = 0; y < src->h; ++y)
+		memcpy(dst->rgb + ((size_t)(y + bd[1]) * dst->w + bd[0]) * 3,
+		       src->rgb + (size_t)y * src->w * 3, (size_t)src->w * 3);
+}
+
+static void
+save_jpeg(const char *path, const struct img *im, int quality, bool progressive) {
+	tjhandle th;
+	unsigned char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if (!(th = tj3Init(TJINIT_COMPRESS)))
+		errx(1, "Unable to initialize compressor");
+	tj3Set(th, TJPARAM_QUALITY, quality);
+	tj3Set(th, TJPARAM_SUBSAMP, TJSAMP_420);
+	tj3Set(th, TJPARAM_PROGRESSIVE, progressive);
+	if (tj3Compress8(th, im->rgb, im->w, 0, im->h, TJPF_RGB, &buf, &len) < 0)
+		errx(1, "compress %s: %s", path, tj3GetErrorStr(th));
+	if (!(fp = fopen(path, "wb")) || fwrite(buf, len, 1, fp) != 1 || fclose(fp))
+		err(1, "write %s", path);
+	tj3Free(buf);
+	tj3Destroy(th);
+}
+
+static void
+save_png(const char *path, const struct img *im) {
+	DATA32 *argb = emalloc((size_t)im->w * im->h * sizeof(*argb));
+	struct stat st;
+
+	for (size_t i = 0; i < (size_t)im->w * im->h; ++i) {
+		const uint8_t *p = im->rgb + 3 * i;
+		argb[i] = 0xff000000u | p[0] << 16 | p[1] << 8 | p[2];
+	}
+	imlib_context_set_image(imlib_create_image_using_data(im->w, im->h, argb));
+	imlib_image_set_format("png");
+	imlib_save_image(path);
+	imlib_free_image();
+	free(argb);
+	if (stat(path, &st) < 0)
+		errx(1, "imlib could not save %s", path);
+}
+
+static void
+generate(const char *dir) {
+	char path[PATH_MAX];
+	FILE *mf;
+	int nfiles = 0;
+
+	snprintf(path, sizeof(path), "%s/img", dir);
+	if ((mkdir(dir, 0777) < 0 && errno != EEXIST) || (mkdir(path, 0777) < 0 && errno != EEXIST))
+		err(1, "mkdir %s", path);
+	snprintf(path, sizeof(path), "%s/manifest.tsv", dir);
+	if (!(mf = fopen(path, "w")))
+		err(1, "fopen %s", path);
+
+	for (int i = 0; i < ncorpus; ++i) {
+		int s = rnd() % (sizeof(sizes) / sizeof(*sizes));
+		char name[64];
+		struct img im;
+
+		paint(&im, sizes[s].w, sizes[s].h);
+		if (rnd() % 10 == 0) {
+			int bd[4] = { rndint(8, 120), rndint(8, 120), rndint(8, 120), rndint(8, 120) };
+			struct img fr;
+
+			frame(&fr, &im, bd);
+			snprintf(name, sizeof(name), "img/%05d-border.jpg", i);
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+			save_jpeg(path, &fr, 92, false);
+			fprintf(mf, "%s\t%d\tborder\t%d\t%d\t%d\t%d\n", name, i, bd[0], bd[1], bd[2], bd[3]);
+			free(fr.rgb);
+			free(im.rgb);
+			++nfiles;
+			continue;
+		}
+
+		if (rnd() % 10 == 0) {
+			snprintf(name, sizeof(name), "img/%05d-orig.png", i);
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+			save_png(path, &im);
+		} else {
+			snprintf(name, sizeof(name), "img/%05d-orig.jpg", i);
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+			save_jpeg(path, &im, rndint(70, 95), rnd() % 3 == 0);
+		}
+		fprintf(mf, "%s\t%d\torig\t0\t0\t0\t0\n", name, i);
+		++nfiles;
+
+		/* planted duplicates */
+		for (int n = rnd() % 100 < 30 ? rndint(1, 2) : 0; n > 0; --n) {
+			enum variant v = rnd() % V_LAST;
+			struct img dup;
+
+			derive(&dup, &im, v);
+			snprintf(name, sizeof(name), "img/%05d-%d-%s.jpg", i, n, vname[v]);
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+			save_jpeg(path, &dup, v == V_REQUAL ? 50 : rndint(70, 95), rnd() % 3 == 0);
+			fprintf(mf, "%s\t%d\t%s\t0\t0\t0\t0\n", name, i, vname[v]);
+			free(dup.rgb);
+			++nfiles;
+		}
+		free(im.rgb);
+		if (verbose > 1)
+			warnx("%d/%d", i + 1, ncorpus);
+	}
+	if (fclose(mf))
+		err(1, "write manifest");
+	if (verbose)
+		warnx("%d files in %s", nfiles, dir);
+}
+
+/*
+ * End-to-end runs. Every tool is run over the corpus as a child at
+ * each thread count, once after evicting the corpus from the page
+ * cache and once warm, and timed with its peak RSS from wait4().
+ * The outputs are then checked against the manifest.
+ */
+struct entry {
+	char path[64];
+	char kind[16];
+	int group;
+	int bd[4];
+	off_t size;
+	int found; /* jpgtrim agrees with the planted borders */
+};
+
+static struct entry *ents;
+static size_t nents;
+static off_t totbytes;
+static bool firstrun = true;
+static int failed = 0;
+
+static int
+entcmp(const void *a, const void *b) {
+	return strcmp(((const struct entry *)a)->path, ((const struct entry *)b)->path);
+}
+
+static struct entry *
+lookup(const char *dir, const char *path) {
+	struct entry key;
+	size_t dl = strlen(dir);
+
+	if (strncmp(path, dir, dl) || path[dl] != '/')
+		return NULL;
+	snprintf(key.path, sizeof(key.path), "%s", path + dl + 1);
+	return bsearch(&key, ents, nents, sizeof(*ents), entcmp);
+}
+
+static void
+load_manifest(const char *dir) {
+	char path[PATH_MAX];
+	char line[256];
+	size_t cap = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/manifest.tsv", dir);
+	if (!(fp = fopen(path, "r")))
+		err(1, "fopen %s", path);
+	while (fgets(line, sizeof(line), fp)) {
+		struct entry *e;
+		struct stat st;
+
+		if (nents == cap) {
+			cap = cap ? 2 * cap : 1024;
+			ents = erealloc(ents, cap * sizeof(*ents));
+		}
+		e = &ents[nents];
+		memset(e, 0, sizeof(*e));
+		if (sscanf(line, "%63s %d %15s %d %d %d %d", e->path, &e->group, e->kind,
+		           &e->bd[0], &e->bd[1], &e->bd[2], &e->bd[3]) != 7)
+			errx(1, "bad manifest line: %s", line);
+		snprintf(path, sizeof(path), "%s/%s", dir, e->path);
+		if (stat(path, &st) < 0)
+			err(1, "stat %s", path);
+		e->size = st.st_size;
+		totbytes += st.st_size;
+		++nents;
+	}
+	fclose(fp);
+	if (!nents)
+		errx(1, "empty manifest in %s", dir);
+	qsort(ents, nents, sizeof(*ents), entcmp);
+}
+
+/* best effort: written pages are flushed first, as dirty ones stay */
+static void
+evict(const char *path) {
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		warn("open %s", path);
+		return;
+	}
+	fsync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static void
+evict_corpus(const char *dir) {
+	char path[PATH_MAX];
+
+	for (size_t i = 0; i < nents; ++i) {
+		snprintf(path, sizeof(path), "%s/%s", dir, ents[i].path);
+		evict(path);
+	}
+}
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+spawn(const char *tool, int nthreads, bool cold, char *argv[], const char *out, size_t nfiles, off_t nbytes) {
+	struct rusage ru;
+	double t0, wall;
+	int status;
+	pid_t pid;
+
+	t0 = now();
+	if ((pid = fork()) < 0)
+		err(1, "fork");
+	if (!pid) {
+		char errpath[PATH_MAX];
+		int fd;
+
+		snprintf(errpath, sizeof(errpath), "%s.err", out);
+		if ((fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 || dup2(fd, 1) < 0)
+			err(127, "%s", out);
+		if ((fd = open(errpath, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 || dup2(fd, 2) < 0)
+			err(127, "%s", errpath);
+		execv(argv[0], argv);
+		err(127, "exec %s", argv[0]);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0)
+		err(1, "wait4");
+	wall = now() - t0;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		warnx("%s -T %d exited with %d, see %s.err", tool, nthreads,
+		      WIFEXITED(status) ? WEXITSTATUS(status) : -1, out);
+		failed = 1;
+	}
+	printf(firstrun ? "\n" : ",\n");
+	printf("\t\t{ \"tool\":\"%s\", \"threads\":%d, \"cache\":\"%s\", \"exit\":%d, "
+	       "\"files\":%lu, \"bytes\":%ld, \"wall_s\":%.3f, "
+	       "\"files_per_s\":%.1f, \"mb_per_s\":%.2f, \"peak_rss_kb\":%ld }",
+	       tool, nthreads, cold ? "cold" : "warm",
+	       WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+	       nfiles, nbytes, wall, nfiles / wall, nbytes / wall / 1e6, ru.ru_maxrss);
+	fflush(stdout);
+	firstrun = false;
+}
+
+static FILE *
+open_output(const char *path) {
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r")))
+		err(1, "fopen %s", path);
+	return fp;
+}
+
+static void
+check_imghash(const char *dir, const char *out) {
+	FILE *fp = open_output(out);
+	char line[PATH_MAX + 64];
+	size_t hashed = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strstr(line, "\"path\":"))
+			++hashed;
+	}
+	fclose(fp);
+	if (hashed != nents)
+		failed = 1;
+	printf("\t\t\"imghash\": { \"files\":%lu, \"hashed\":%lu }", nents, hashed);
+}
+
+/*
+ * The JSON of imgdups -a has one group per array and one member per
+ * "path" line, which is all that's needed here.
+ */
+static void
+check_imgdups(const char *dir, const char *out) {
+	FILE *fp = open_output(out);
+	char line[PATH_MAX + 64];
+	size_t planted = 0, found = 0, extra = 0;
+	struct entry **grp = emalloc(nents * sizeof(*grp));
+	size_t ngrp = 0;
+	int ngroups = 0;
+
+	for (size_t i = 0; i < nents; ++i)
+		for (size_t j = i + 1; j < nents; ++j)
+			planted += ents[i].group == ents[j].group;
+
+	for (bool more = true; more;) {
+		char *p, *q;
+
+		more = fgets(line, sizeof(line), fp);
+		if (!more || strchr(line, '[') || strchr(line, ']')) {
+			for (size_t i = 0; i < ngrp; ++i)
+				for (size_t j = i + 1; j < ngrp; ++j)
+					grp[i]->group == grp[j]->group ? ++found : ++extra;
+			ngroups += ngrp > 0;
+			ngrp = 0;
+			continue;
+		}
+		if (!(p = strstr(line, "\"path\":\"")) || !(q = strchr(p += 8, '"')))
+			continue;
+		*q = 0;
+		struct entry *e = lookup(dir, p);
+		if (e && ngrp < nents)
+			grp[ngrp++] = e;
+	}
+	fclose(fp);
+	free(grp);
+	printf("\t\t\"imgdups\": { \"threshold\":%d, \"groups\":%d, \"planted_pairs\":%lu, "
+	       "\"found_pairs\":%lu, \"extra_pairs\":%lu }", threshold, ngroups, planted, found, extra);
+}
+
+/*
+ * jpgtrim -vv reports each edge it would crop with its margin added.
+ * Files without planted borders count as spurious if trimmed deeper
+ * than the tolerance.
+ */
+static void
+check_jpgtrim(const char *dir, const char *out) {
+	FILE *fp = open_output(out);
+	char line[PATH_MAX + 128];
+	char path[PATH_MAX];
+	int bordered = 0, detected = 0, spurious = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		int crop, bd[4];
+		struct entry *e;
+
+		if (sscanf(line, "%s %d l=%d t=%d r=%d b=%d", path, &crop, &bd[0], &bd[1], &bd[2], &bd[3]) != 6)
+			continue;
+		if (!(e = lookup(dir, path)))
+			continue;
+		e->found = 1;
+		for (int k = 0; k < 4; ++k) {
+			if (abs(bd[k] - JPGTRIM_MARGIN - e->bd[k]) > tolerance)
+				e->found = 0;
+		}
+		if (strcmp(e->kind, "border"))
+			spurious += !e->found;
+	}
+	fclose(fp);
+	for (size_t i = 0; i < nents; ++i) {
+		if (!strcmp(ents[i].kind, "border")) {
+			++bordered;
+			detected += ents[i].found;
+		}
+	}
+	printf("\t\t\"jpgtrim\": { \"bordered\":%d, \"detected\":%d, \"tolerance\":%d, \"spurious\":%d }",
+	       bordered, detected, tolerance, spurious);
+}
+
+static void
+bench(const char *dir) {
+	char tool[PATH_MAX], imgdir[PATH_MAX], outdir[PATH_MAX];
+	char hashes[PATH_MAX + 16], dups[PATH_MAX + 16], trims[PATH_MAX + 16];
+	char tbuf[16], lbuf[16];
+	int threads[32], nthreads = 0;
+	struct stat st;
+	char **jargv;
+	size_t njpeg = 0;
+	off_t jbytes = 0;
+
+	for (const char *p = threadlist; *p && nthreads < 32;) {
+		char *end;
+		threads[nthreads] = strtol(p, &end, 10);
+		if (end == p || threads[nthreads] < 1)
+			errx(1, "bad thread list %s", threadlist);
+		++nthreads;
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	load_manifest(dir);
+	snprintf(imgdir, sizeof(imgdir), "%s/img", dir);
+	snprintf(outdir, sizeof(outdir), "%s/out", dir);
+	if (mkdir(outdir, 0777) < 0 && errno != EEXIST)
+		err(1, "mkdir %s", outdir);
+	snprintf(hashes, sizeof(hashes), "%s/imghash.json", outdir);
+	snprintf(dups, sizeof(dups), "%s/imgdups.json", outdir);
+	snprintf(trims, sizeof(trims), "%s/jpgtrim.txt", outdir);
+	snprintf(lbuf, sizeof(lbuf), "%d", threshold);
+
+	printf("{\n");
+	printf("\t\"corpus\":\"%s\",\n", dir);
+	printf("\t\"files\":%lu,\n", nents);
+	printf("\t\"bytes\":%ld,\n", totbytes);
+	printf("\t\"runs\":[");
+
+	snprintf(tool, sizeof(tool), "%s/imghash", bindir);
+	for (int i = 0; i < nthreads; ++i) {
+		for (int cold = 1; cold >= 0; --cold) {
+			char *argv[] = { tool, (char *)"-a", (char *)"-t", (char *)"-T", tbuf, imgdir, NULL };
+			snprintf(tbuf, sizeof(tbuf), "%d", threads[i]);
+			if (cold)
+				evict_corpus(dir);
+			spawn("imghash", threads[i], cold, argv, hashes, nents, totbytes);
+		}
+	}
+
+	if (stat(hashes, &st) < 0)
+		err(1, "stat %s", hashes);
+	snprintf(tool, sizeof(tool), "%s/imgdups", bindir);
+	for (int i = 0; i < nthreads; ++i) {
+		for (int cold = 1; cold >= 0; --cold) {
+			char *argv[] = { tool, (char *)"-a", (char *)"-l", lbuf, (char *)"-T", tbuf, hashes, NULL };
+			snprintf(tbuf, sizeof(tbuf), "%d", threads[i]);
+			if (cold)
+				evict(hashes);
+			spawn("imgdups", threads[i], cold, argv, dups, nents, st.st_size);
+		}
+	}
+
+	/* jpgtrim takes JPEGs and PNGs */
+	snprintf(tool, sizeof(tool), "%s/jpgtrim", bindir);
+	jargv = emalloc((nents + 6) * sizeof(*jargv));
+	jargv[0] = tool;
+	jargv[1] = (char *)"-d";
+	jargv[2] = (char *)"-vv";
+	jargv[3] = (char *)"-T";
+	jargv[4] = tbuf;
+	for (size_t i = 0; i < nents; ++i) {
+		const char *ext = strrchr(ents[i].path, '.');
+		if (!ext || (strcmp(ext, ".jpg") && strcmp(ext, ".png")))
+			continue;
+		jargv[5 + njpeg] = emalloc(PATH_MAX);
+		snprintf(jargv[5 + njpeg++], PATH_MAX, "%s/%s", dir, ents[i].path);
+		jbytes += ents[i].size;
+	}
+	jargv[5 + njpeg] = NULL;
+	for (int i = 0; i < nthreads; ++i) {
+		for (int cold = 1; cold >= 0; --cold) {
+			snprintf(tbuf, sizeof(tbuf), "%d", threads[i]);
+			if (cold)
+				evict_corpus(dir);
+			spawn("jpgtrim", threads[i], cold, jargv, trims, njpeg, jbytes);
+		}
+	}
+	for (size_t i = 0; i < njpeg; ++i)
+		free(jargv[5 + i]);
+	free(jargv);
+
+	printf("\n\t],\n");
+	printf("\t\"checks\":{\n");
+	check_imghash(dir, hashes);
+	printf(",\n");
+	check_imgdups(dir, dups);
+	printf(",\n");
+	check_jpgtrim(dir, trims);
+	printf("\n\t}\n}\n");
+	free(ents);
+}
+
+static const struct optparse_long longopts[] = {
+	{ "generate",       'g', OPTPARSE_REQUIRED },
+	{ "bench",          'b', OPTPARSE_REQUIRED },
+	{ "count",          'n', OPTPARSE_REQUIRED },
+	{ "seed",           's', OPTPARSE_REQUIRED },
+	{ "bindir",         'p', OPTPARSE_REQUIRED },
+	{ "threads",        'T', OPTPARSE_REQUIRED },
+	{ "threshold",      'l', OPTPARSE_REQUIRED },
+	{ "tolerance",      't', OPTPARSE_REQUIRED },
+	{ "verbose",        'v', OPTPARSE_NONE },
+	{ "quiet",          'q', OPTPARSE_NONE },
+	{ 0 },
+};
+
+static void
+usage(void) {
+	printf("usage: %s [opts]\n", progname);
+	optparse_dump_options(longopts);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *gendir = NULL;
+	const char *benchdir = NULL;
+	struct optparse op;
+	long opt;
+
+	optparse_init(&op, argv);
+	while ((opt = optparse_long(&op, longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'g':
+			gendir = op.optarg;
+			break;
+		case 'b':
+			benchdir = op.optarg;
+			break;
+		case 'n':
+			if ((ncorpus = atoi(op.optarg)) < 1)
+				usage();
+			break;
+		case 's':
+			seed = strtoull(op.optarg, NULL, 0);
+			if (!seed)
+				usage();
+			break;
+		case 'p':
+			bindir = op.optarg;
+			break;
+		case 'T':
+			threadlist = op.optarg;
+			break;
+		case 'l':
+			threshold = atoi(op.optarg);
+			break;
+		case 't':
+			tolerance = atoi(op.optarg);
+			break;
+		case 'v':
+			++verbose;
+			break;
+		case 'q':
+			--verbose;
+			break;
+		case '?':
+			warnx("%s", op.errmsg);
+			usage();
+			break;
+		}
+	}
+	if (op.optind < argc || (!gendir && !benchdir))
+		usage();
+
+	if (gendir)
+		generate(gendir);
+	if (benchdir)
+		bench(benchdir);
+	return failed;
+}
@@ -25,6 +25,14 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <time.h>
@@ -37,6 +45,10 @@
 #include <yajl/yajl_gen.h>
 #include "_optparse.h"
 #include "imgcmp.h"
+#include "popcnt.h"
+#include "progress.h"
+#include "stats.h"
+#include "thpool.h"
 #include "util.h"
 
 static const char progname[] = "imgdups";
@@ -46,46 +58,73 @@ static bool jsondump = false;
 static int threshold = 1;
 static int verbose = 1;
 static bool missing_ok = false;
-static struct item_t *g_head = NULL;
-static char *last_key;
-
-static char *
-mkstr(const unsigned char *val, size_t len) {
-	char *ret = emalloc(len + 1);
-	ret[len] = 0;
-	memcpy(ret, val, len);
-	return ret;
-}
+static struct arena refarena;
+static struct arena itemarena;
+static bool streaming = false;
+static bool sharding = false;
+static bool loading = false;
+static struct dedup sdd;
+static struct matchidx refidx;
+static int nthreads = 8;
+static int knn = 0;
+static threadpool threads;
+static uint64_t nparsed;
+static uint64_t nloaded;
+static uint64_t nskipped;
+
+/* per parser state, passed to the callbacks as context */
+struct jstate {
+	struct item_t *head;
+	struct arena *arena;
+	char key[16];
+	int depth;	/* of arrays inside a record */
+};
+
+static struct jstate g_js = { .arena = &itemarena };
+
+static void stream_add(struct item_t *);
+static void shard_add(struct item_t *);
 
-#define STOREATIF(attr, key) do {	\
-	if (!strcmp(last_key, key)) {	\
-		g_head->attr = val;	\
+#define STOREATIF(attr, name) do {	\
+	if (!strcmp(js->key, name)) {	\
+		js->head->attr = val;	\
 		return 1;		\
 	} } while (0)
 
 static int
 jstr(void *ctx, const unsigned char *str, size_t len) {
-	char *val = mkstr(str, len);
-	if (!last_key || !g_head)
+	struct jstate *js = ctx;
+	if (!*js->key || !js->head)
 		return 0;
-	STOREATIF(path, "path");
-	free(val);
+	if (!strcmp(js->key, "path")) {
+		js->head->path = arena_strndup(js->arena, (const char *)str, len);
+		return 1;
+	}
+	if (!strcmp(js->key, "exact")) {
+		js->head->exact = arena_strndup(js->arena, (const char *)str, len);
+		return 1;
+	}
 	return 0;
 }
 
 static int
 jnum(void *ctx, const char *str, size_t len) {
+	struct jstate *js = ctx;
 	char *end;
 	unsigned long val = strtoul(str, &end, 10);
 	if (end - str != (long int)len)
 		return 0;
-	if (!last_key || !g_head)
+	if (!*js->key || !js->head)
 		return 0;
+	/* crop and face boxes aren't kept */
+	if (js->depth)
+		return 1;
 	STOREATIF(size, "size");
 	STOREATIF(w, "w");
 	STOREATIF(h, "h");
 	STOREATIF(mtime, "mtime");
 	STOREATIF(etime, "etime");
+	STOREATIF(orient, "orient");
 	STOREATIF(hashes[TI_BASE], "base");
 	STOREATIF(hashes[TI_ROT1], "rot1");
 	STOREATIF(hashes[TI_ROT2], "rot2");
@@ -99,37 +138,63 @@ jnum(void *ctx, const char *str, size_t len) {
 
 static int
 jkey(void *ctx, const unsigned char *str, size_t len) {
-	char *val = mkstr(str, len);
-	if (last_key)
-		free(last_key);
-	last_key = val;
+	struct jstate *js = ctx;
+	/* all keys we care about are short, others never match */
+	if (len >= sizeof(js->key))
+		len = 0;
+	memcpy(js->key, str, len);
+	js->key[len] = 0;
 	return 1;
 }
 
 static int
 jmaps(void *ctx) {
-	struct item_t *item = ecalloc(1, sizeof(*item));
-	item->next = g_head;
+	struct jstate *js = ctx;
+	struct item_t *item = arena_alloc(js->arena, sizeof(*item));
+	item->next = js->head;
 	item->eq_dist = -1;
 	item->eq_trans = TI_LAST;
-	g_head = item;
+	js->head = item;
+	counter_add(&nloaded, 1);
 	return 1;
 }
 
 static int
 jmape(void *ctx) {
-	if (!g_head || !g_head->path)
+	struct jstate *js = ctx;
+	if (!js->head || !js->head->path)
 		return 0;
-	if (!missing_ok && access(g_head->path, F_OK) != 0) {
+	if (!missing_ok && access(js->head->path, F_OK) != 0) {
 		if (verbose > 1) {
-			warnx("skipping missing file %s", g_head->path);
+			warnx("skipping missing file %s", js->head->path);
 		}
-		g_head = free_item(g_head);
-	}
-	if (last_key) {
-		free(last_key);
-		last_key = NULL;
+		/* left in the arena until it's released */
+		js->head = js->head->next;
+		counter_add(&nskipped, 1);
+	} else if (streaming) {
+		stream_add(js->head);
+		js->head = NULL;
+	} else if (sharding) {
+		shard_add(js->head);
+		js->head = NULL;
 	}
+	*js->key = 0;
+	return 1;
+}
+
+static int
+jarrs(void *ctx) {
+	struct jstate *js = ctx;
+	if (*js->key)
+		++js->depth;
+	return 1;
+}
+
+static int
+jarre(void *ctx) {
+	struct jstate *js = ctx;
+	if (js->depth)
+		--js->depth;
 	return 1;
 }
 
@@ -139,28 +204,33 @@ static yajl_callbacks jcb = {
 	.yajl_map_key = jkey,
 	.yajl_end_map = jmape,
 	.yajl_number = jnum,
+	.yajl_start_array = jarrs,
+	.yajl_end_array = jarre,
 };
 
 
-static size_t
-dist(uint64_t a, uint64_t b) {
-	uint64_t c;
-	size_t d = 0;
-
-	for (c = a^b; c; c &= c - 1)
-		++d;
-	return d;
+/* exact copies follow the item they copy, at a distance of 0 */
+static void
+putcopies(const struct item_t *item) {
+	for (struct item_t *c = item->copies; c; c = c->next) {
+		if (jsondump) {
+			c->eq_trans = TI_BASE;
+			c->eq_dist = 0;
+			fputjson(jfp, "\t\t", c, false);
+		} else {
+			fprintf(stdout, "%s\n", c->path);
+		}
+	}
 }
 
 static void
-postproc(struct item_t *items) {
+postproc(const struct itemset *refs, const struct itemset *set) {
 	static bool first = true;
-	struct item_t *ref;
-	struct item_t *tmp;
 
+	for (size_t r = 0; r < refs->n; ++r) {
+		struct item_t *ref = refs->items[r];
 
-	for (ref = items; ref; ref = ref->next) {
-		if (!ref->eq_n)
+		if (!refs->eq_n[r] && !ref->copies)
 			continue;
 
 		if (jsondump)
@@ -170,13 +240,17 @@ postproc(struct item_t *items) {
 		} else {
 			fprintf(stdout, "%s\n", ref->path);
 		}
-		for (tmp = ref->eq_next; tmp; tmp = tmp->eq_next) {
+		putcopies(ref);
+		for (uint32_t i = refs->eq_next[r]; i != NOIDX; i = set->eq_next[i]) {
+			struct item_t *tmp = set->items[i];
 			if (jsondump) {
-				tmp->eq_dist = dist(ref->hashes[TI_BASE], tmp->hashes[tmp->eq_trans]);
+				tmp->eq_trans = set->eq_trans[i];
+				tmp->eq_dist = hdist(refs->hashes[TI_BASE][r], set->hashes[tmp->eq_trans][i]);
 				fputjson(jfp, "\t\t", tmp, false);
 			} else {
 				fprintf(stdout, "%s\n", tmp->path);
 			}
+			putcopies(tmp);
 		}
 		if (jsondump)
 			fprintf(jfp, "\n\t]");
@@ -184,76 +258,280 @@ postproc(struct item_t *items) {
 	}
 }
 
+#define REFJOB_ITEMS 4096
+
+struct refjob {
+	struct itemset *set;
+	uint32_t start;
+	uint32_t end;
+};
+
+/* claims are only recorded here, linking is left to refcmp() */
+static void
+refmatch(void *arg) {
+	struct refjob *job = arg;
+	struct itemset *set = job->set;
+
+	for (uint32_t i = job->start; i < job->end; ++i) {
+		uint64_t hashes[TI_LAST];
+		enum trans_t t;
+
+		for (t = 0; t < TI_LAST; ++t)
+			hashes[t] = set->hashes[t][i];
+		set->eq_parent[i] = matchidx_find(&refidx, hashes, &t);
+		set->eq_trans[i] = t;
+	}
+}
+
+/*
+ * Every item goes to the first reference it matches. Items are looked
+ * up in the reference index in parallel, then linked in item order,
+ * which gives the same groups and order as comparing all pairs.
+ */
+static void
+refcmp(struct itemset *set, struct itemset *refs) {
+	size_t njobs = (set->n + REFJOB_ITEMS - 1) / REFJOB_ITEMS;
+	struct refjob *jobs = ecalloc(njobs, sizeof(*jobs));
+
+	for (size_t j = 0; j < njobs; ++j) {
+		jobs[j].set = set;
+		jobs[j].start = j * REFJOB_ITEMS;
+		jobs[j].end = j + 1 < njobs ? (j + 1) * REFJOB_ITEMS : set->n;
+		if (threads)
+			thpool_add_work(threads, refmatch, &jobs[j]);
+		else
+			refmatch(&jobs[j]);
+	}
+	if (threads)
+		thpool_wait(threads);
+	free(jobs);
+
+	for (uint32_t tmp = 0; tmp < set->n; ++tmp) {
+		uint32_t p = set->eq_parent[tmp];
+		if (p == NOIDX)
+			continue;
+		set->eq_next[tmp] = refs->eq_next[p];
+		refs->eq_next[p] = tmp;
+		refs->eq_n[p]++;
+	}
+	postproc(refs, set);
+}
+
+/*
+ * k nearest neighbours. Every transform of every item is indexed, and
+ * a query probes with a growing radius per chunk until the k best
+ * found so far are closer than anything that radius could have
+ * missed. Past the point where probing costs more than a scan it
+ * falls back to scanning.
+ */
+#define KNN_CHUNKS HINDEX_MAXCHUNKS
+
+struct nn {
+	uint32_t item;
+	uint8_t dist;
+	uint8_t trans;
+};
+
+/* bounded max-heap on (dist, item), holding each item at most once */
+struct knnq {
+	struct nn *heap;
+	uint32_t n;
+	uint32_t self;
+};
+
+struct knnjob {
+	const struct hindex *idx;
+	const struct itemset *queries;
+	bool self;
+	uint32_t start;
+	uint32_t end;
+	struct nn *res;
+	uint32_t *nres;
+};
+
+static int trank[TI_LAST];
+
 static bool
-hasheq(uint64_t a, uint64_t b) {
-	int d = 0;
-	for (uint64_t c = a^b; c; c &= c - 1)
-		if (++d > threshold)
-			return false;
-	return true;
+nn_less(const struct nn *a, const struct nn *b) {
+	if (a->dist != b->dist)
+		return a->dist < b->dist;
+	return a->item < b->item;
+}
+
+static void
+knn_siftdown(struct knnq *q, uint32_t i) {
+	for (;;) {
+		uint32_t l = 2 * i + 1, r = l + 1, m = i;
+		if (l < q->n && nn_less(&q->heap[m], &q->heap[l]))
+			m = l;
+		if (r < q->n && nn_less(&q->heap[m], &q->heap[r]))
+			m = r;
+		if (m == i)
+			return;
+		struct nn tmp = q->heap[i];
+		q->heap[i] = q->heap[m];
+		q->heap[m] = tmp;
+		i = m;
+	}
+}
+
+static void
+knn_siftup(struct knnq *q, uint32_t i) {
+	while (i && nn_less(&q->heap[(i - 1) / 2], &q->heap[i])) {
+		struct nn tmp = q->heap[i];
+		q->heap[i] = q->heap[(i - 1) / 2];
+		q->heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
 }
 
 static int
-cmp_items(const struct item_t *a, const struct item_t *b) {
-#define _CMP(t) do {						\
-	if (hasheq(a->hashes[TI_BASE], b->hashes[t]))		\
-		return TI_LAST + t;				\
-	} while(0)
-
-	_CMP(TI_BASE);
-	_CMP(TI_FLIP);
-	_CMP(TI_ROT1);
-	_CMP(TI_ROT2);
-	_CMP(TI_ROT3);
-	_CMP(TI_FLR1);
-	_CMP(TI_FLR2);
-	_CMP(TI_FLR3);
+knn_push(void *ctx, uint32_t id, int d) {
+	struct knnq *q = ctx;
+	struct nn e = { .item = id / TI_LAST, .dist = d, .trans = id % TI_LAST };
+
+	if (e.item == q->self)
+		return 0;
+	for (uint32_t i = 0; i < q->n; ++i) {
+		struct nn *h = &q->heap[i];
+		if (h->item != e.item)
+			continue;
+		if (e.dist < h->dist || (e.dist == h->dist && trank[e.trans] < trank[h->trans])) {
+			*h = e;
+			knn_siftdown(q, i);
+		}
+		return 0;
+	}
+	if (q->n < (uint32_t)knn) {
+		q->heap[q->n++] = e;
+		knn_siftup(q, q->n - 1);
+	} else if (nn_less(&e, &q->heap[0])) {
+		q->heap[0] = e;
+		knn_siftdown(q, 0);
+	}
 	return 0;
 }
 
+static size_t
+ball(int bits, int radius) {
+	size_t sum = 0, c = 1;
+	for (int k = 0; k <= radius && k <= bits; ++k) {
+		sum += c;
+		c = c * (bits - k) / (k + 1);
+	}
+	return sum;
+}
+
 static void
-handle_pair(struct item_t *ref, struct item_t *tmp) {
-	int eqt;
+knn_search(const struct hindex *idx, uint64_t hash, struct knnq *q) {
+	for (int rho = 0; ; ++rho) {
+		int covered = idx->nchunks * (rho + 1) - 1;
 
-	if (tmp->eq_parent)
-		return;
-	
-	if ((eqt = cmp_items(ref, tmp))) {
-		struct item_t *p;
-		for (p = ref; p->eq_parent; p = p->eq_parent);
-		tmp->eq_parent = p;
-		tmp->eq_next = p->eq_next;
-		tmp->eq_trans = eqt - TI_LAST;
-		p->eq_next = tmp;
-		p->eq_n++;
+		if (covered >= 64 || ball(64 / idx->nchunks, rho) * idx->nchunks >= idx->n) {
+			for (uint32_t id = 0; id < idx->n; ++id)
+				knn_push(q, id, hdist(idx->keys[id], hash));
+			return;
+		}
+		hindex_query(idx, hash, covered, knn_push, q);
+		if (q->n == (uint32_t)knn && q->heap[0].dist <= covered)
+			return;
 	}
 }
 
-static void
-refcmp(struct item_t *items, struct item_t *refs) {
-	struct item_t *ref;
-	struct item_t *tmp;
+static int
+nn_cmp(const void *a, const void *b) {
+	return nn_less(a, b) ? -1 : nn_less(b, a);
+}
 
-	for (ref = refs; ref; ref = ref->next) {
-		for (tmp = items; tmp; tmp = tmp->next) {
-			handle_pair(ref, tmp);
+static void
+knn_match(void *arg) {
+	struct knnjob *job = arg;
 
-		}
+	for (uint32_t i = job->start; i < job->end; ++i) {
+		struct knnq q = {
+			.heap = job->res + (size_t)i * knn,
+			.self = job->self ? i : NOIDX,
+		};
+		knn_search(job->idx, job->queries->hashes[TI_BASE][i], &q);
+		qsort(q.heap, q.n, sizeof(*q.heap), nn_cmp);
+		job->nres[i] = q.n;
 	}
-	postproc(refs);
 }
 
 static void
-intracmp(struct item_t *items) {
-	struct item_t *ref;
-	struct item_t *tmp;
+knncmp(struct itemset *set, struct itemset *refs) {
+	const struct itemset *queries = refs ? refs : set;
+	size_t njobs = (queries->n + REFJOB_ITEMS - 1) / REFJOB_ITEMS;
+	struct knnjob *jobs = ecalloc(njobs, sizeof(*jobs));
+	struct nn *res = emalloc(queries->n * knn * sizeof(*res));
+	uint32_t *nres = emalloc(queries->n * sizeof(*nres));
+	static bool first = true;
+	struct hindex idx;
+
+	for (size_t k = 0; k < TI_LAST; ++k)
+		trank[cmp_order[k]] = k;
+
+	hindex_init(&idx, KNN_CHUNKS);
+	hindex_reserve(&idx, set->n * TI_LAST);
+	for (uint32_t i = 0; i < set->n; ++i) {
+		for (size_t t = 0; t < TI_LAST; ++t)
+			hindex_add(&idx, set->hashes[t][i]);
+	}
+
+	for (size_t j = 0; j < njobs; ++j) {
+		jobs[j] = (struct knnjob){
+			.idx = &idx,
+			.queries = queries,
+			.self = !refs,
+			.start = j * REFJOB_ITEMS,
+			.end = j + 1 < njobs ? (j + 1) * REFJOB_ITEMS : queries->n,
+			.res = res,
+			.nres = nres,
+		};
+		if (threads)
+			thpool_add_work(threads, knn_match, &jobs[j]);
+		else
+			knn_match(&jobs[j]);
+	}
+	if (threads)
+		thpool_wait(threads);
+	free(jobs);
+	hindex_free(&idx);
 
-	for (ref = items; ref; ref = ref->next) {
-		for (tmp = ref->next; tmp; tmp = tmp->next) {
-			handle_pair(ref, tmp);
+	for (uint32_t r = 0; r < queries->n; ++r) {
+		const struct nn *nn = res + (size_t)r * knn;
+
+		if (!nres[r])
+			continue;
+		if (jsondump) {
+			fprintf(jfp, first ? "\t[" : ",[");
+			fputjson(jfp, "\t\t", queries->items[r], true);
+		} else {
+			fprintf(stdout, "%s\n", queries->items[r]->path);
 		}
+		for (uint32_t i = 0; i < nres[r]; ++i) {
+			struct item_t tmp = *set->items[nn[i].item];
+			if (jsondump) {
+				tmp.eq_dist = nn[i].dist;
+				tmp.eq_trans = nn[i].trans;
+				fputjson(jfp, "\t\t", &tmp, false);
+			} else {
+				fprintf(stdout, "\t%d\t%s\t%s\n", nn[i].dist,
+				        tname(nn[i].trans), tmp.path);
+			}
+		}
+		if (jsondump)
+			fprintf(jfp, "\n\t]");
+		first = false;
 	}
-	postproc(items);
+	free(res);
+	free(nres);
+}
+
+static void
+intracmp(struct itemset *set) {
+	itemset_group(set, threshold);
+	postproc(set, set);
 }
 
 static const struct optparse_long longopts[] = {
@@ -265,8 +543,23 @@ static const struct optparse_long longopts[] = {
 	{ "stdin",          'i', OPTPARSE_NONE },
 	{ "missing-ok",     'x', OPTPARSE_NONE },
 	{ "reference-files",'R', OPTPARSE_REQUIRED },
+	{ "save-reference-index", 'W', OPTPARSE_REQUIRED },
+	{ "threads",        'T', OPTPARSE_REQUIRED },
+	{ "knn",            'k', OPTPARSE_REQUIRED },
+	{ "shard-dir",      'D', OPTPARSE_REQUIRED },
+	{ "shards",         'N', OPTPARSE_REQUIRED },
+	{ "memory-budget",  'M', OPTPARSE_REQUIRED },
 	{ "intragroupcheck",'G', OPTPARSE_NONE },
 
+	{ "stream",         's', OPTPARSE_NONE },
+	{ "socket",         'S', OPTPARSE_REQUIRED },
+	{ "checkpoint",     'C', OPTPARSE_REQUIRED },
+	{ "checkpoint-interval", 'I', OPTPARSE_REQUIRED },
+
+	{ "progress",       'p', OPTPARSE_NONE },
+	{ "metrics",        'm', OPTPARSE_REQUIRED },
+	{ "metrics-interval",'e', OPTPARSE_REQUIRED },
+
 	{ "dedup",          'd', OPTPARSE_NONE },
 	{ "zsh-comp-gen", -3515, OPTPARSE_NONE },
 	{ 0 },
@@ -279,12 +572,45 @@ usage() {
 	exit(1);
 }
 
+enum {
+	M_LOADED, M_SKIPPED, M_PARSED, M_COMPARED, M_BUSY, M_THREADS, M_LAST,
+};
+
+static struct pmetric metrics[M_LAST] = {
+	[M_LOADED]   = { "items_loaded", "Items parsed.", PM_COUNTER, "items" },
+	[M_SKIPPED]  = { "items_skipped", "Items skipped as missing.", PM_COUNTER, "skipped" },
+	[M_PARSED]   = { "parsed_bytes", "Bytes of JSON parsed.", PM_COUNTER, "bytes" },
+	[M_COMPARED] = { "comparisons", "Hash comparisons.", PM_COUNTER, "cmp" },
+	[M_BUSY]     = { "threads_busy", "Workers busy.", PM_GAUGE, "busy" },
+	[M_THREADS]  = { "threads", "Workers.", PM_GAUGE, NULL },
+};
+
+static void
+sample(struct pmetric *m, void *ctx) {
+	threadpool tp = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+
+	m[M_LOADED].value = counter_get(&nloaded);
+	m[M_SKIPPED].value = counter_get(&nskipped);
+	m[M_PARSED].value = counter_get(&nparsed);
+	m[M_COMPARED].value = __atomic_load_n(&hcount, __ATOMIC_RELAXED);
+	m[M_BUSY].value = tp ? thpool_num_threads_working(tp) : 0;
+	m[M_THREADS].value = nthreads;
+}
+
+static struct progress progress = {
+	.prog = progname,
+	.interval = 15,
+	.m = metrics,
+	.n = M_LAST,
+	.sample = sample,
+};
+
 static void
 parse_json(FILE *fp, const char *name) {
 	yajl_handle hand;
 	size_t bufsiz = 4096;
 	uint8_t *data;
-	hand = yajl_alloc(&jcb, NULL, NULL);
+	hand = yajl_alloc(&jcb, NULL, &g_js);
 
 	data = emalloc(bufsiz);
 
@@ -297,6 +623,7 @@ parse_json(FILE *fp, const char *name) {
 			}
 			break;
 		}
+		counter_add(&nparsed, rd);
 		if (yajl_parse(hand, data, rd) != yajl_status_ok) {
 			errx(1, "Unable to parse json past %lu in %s\n",
 			       yajl_get_bytes_consumed(hand), name);
@@ -319,21 +646,812 @@ read_file(const char *path) {
 	fclose(fp);
 }
 
+static const char refmagic[8] = "IMGDREF2";
+
+struct refrec {
+	uint64_t hashes[TI_LAST];
+	int64_t mtime;
+	int64_t etime;
+	uint64_t path;
+	int32_t w;
+	int32_t h;
+	int32_t size;
+	int32_t pad;
+};
+
+static bool
+is_refindex(const char *path) {
+	char magic[sizeof(refmagic)];
+	FILE *fp;
+	bool ret;
+
+	if (!(fp = fopen(path, "rb")))
+		err(1, "fopen %s", path);
+	ret = fread(magic, sizeof(magic), 1, fp) == 1
+	   && !memcmp(magic, refmagic, sizeof(magic));
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * A reference index file holds the reference items followed by their
+ * hindex, so later runs can pass it to -R instead of the JSON. Files
+ * missing since are skipped as for JSON references, which leaves the
+ * index numbering them all unusable, so it's dropped then.
+ */
+static void
+save_refs(const char *path, const struct itemset *refs) {
+	uint64_t hdr[2] = { refs->n, 0 };
+	FILE *fp;
+	int ret = 0;
+
+	for (size_t i = 0; i < refs->n; ++i)
+		hdr[1] += strlen(refs->items[i]->path) + 1;
+
+	if (!(fp = fopen(path, "wb")))
+		err(1, "fopen %s", path);
+	if (fwrite(refmagic, sizeof(refmagic), 1, fp) != 1
+	 || fwrite(hdr, sizeof(hdr), 1, fp) != 1)
+		ret = -1;
+	for (size_t i = 0, off = 0; !ret && i < refs->n; ++i) {
+		const struct item_t *item = refs->items[i];
+		struct refrec rec = {
+			.mtime = item->mtime,
+			.etime = item->etime,
+			.path = off,
+			.w = item->w,
+			.h = item->h,
+			.size = item->size,
+		};
+		memcpy(rec.hashes, item->hashes, sizeof(rec.hashes));
+		off += strlen(item->path) + 1;
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+			ret = -1;
+	}
+	for (size_t i = 0; !ret && i < refs->n; ++i) {
+		const char *p = refs->items[i]->path;
+		if (fwrite(p, strlen(p) + 1, 1, fp) != 1)
+			ret = -1;
+	}
+	if (ret || matchidx_write(fp, &refidx) < 0 || fclose(fp))
+		err(1, "write %s", path);
+}
+
+static struct item_t *
+load_refs(const char *path, bool *indexed) {
+	struct item_t *head = NULL;
+	struct item_t **tail = &head;
+	struct refrec *recs;
+	uint64_t hdr[2];
+	char magic[sizeof(refmagic)];
+	char *paths;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "rb")))
+		err(1, "fopen %s", path);
+	if (fread(magic, sizeof(magic), 1, fp) != 1
+	 || fread(hdr, sizeof(hdr), 1, fp) != 1
+	 || memcmp(magic, refmagic, sizeof(magic)) || !hdr[0] || !hdr[1])
+		errx(1, "bad reference index %s", path);
+
+	recs = emalloc(hdr[0] * sizeof(*recs));
+	paths = arena_alloc(&refarena, hdr[1]);
+	if (fread(recs, sizeof(*recs), hdr[0], fp) != hdr[0]
+	 || fread(paths, hdr[1], 1, fp) != 1
+	 || paths[hdr[1] - 1]
+	 || matchidx_read(fp, &refidx) < 0
+	 || refidx.idx.n != hdr[0])
+		errx(1, "bad or truncated reference index %s", path);
+	fclose(fp);
+
+	*indexed = true;
+	for (size_t i = 0; i < hdr[0]; ++i) {
+		struct item_t *item;
+		if (recs[i].path >= hdr[1])
+			errx(1, "bad reference index %s", path);
+		if (!missing_ok && access(paths + recs[i].path, F_OK) != 0) {
+			if (verbose > 1)
+				warnx("skipping missing file %s", paths + recs[i].path);
+			counter_add(&nskipped, 1);
+			*indexed = false;
+			continue;
+		}
+		item = arena_alloc(&refarena, sizeof(*item));
+		memcpy(item->hashes, recs[i].hashes, sizeof(item->hashes));
+		item->path = paths + recs[i].path;
+		item->mtime = recs[i].mtime;
+		item->etime = recs[i].etime;
+		item->w = recs[i].w;
+		item->h = recs[i].h;
+		item->size = recs[i].size;
+		item->eq_dist = -1;
+		item->eq_trans = TI_LAST;
+		*tail = item;
+		tail = &item->next;
+	}
+	free(recs);
+	if (!*indexed)
+		matchidx_free(&refidx);
+	if (!head)
+		errx(1, "no references in %s", path);
+	return head;
+}
+
 static struct item_t *
 reset_head(void) {
-	struct item_t *ret = g_head;
-	g_head = NULL;
+	struct item_t *ret = g_js.head;
+	g_js.head = NULL;
 	return ret;
 }
 
+static int
+pathcmp(const void *a, const void *b) {
+	return strcmp((*(struct item_t *const *)a)->path, (*(struct item_t *const *)b)->path);
+}
+
+/*
+ * Take the exact copies imghash marked out of the list and hang them
+ * on the item they copy, if that is in it, so they are grouped without
+ * being compared.
+ */
+static struct item_t *
+split_copies(struct item_t *items) {
+	struct item_t **byname, *item, *next, *head = NULL, **tail = &head;
+	size_t n = 0, m = 0;
+
+	for (item = items; item; item = item->next) {
+		n += !item->exact;
+		m += !!item->exact;
+	}
+	if (!m)
+		return items;
+	byname = emalloc(n * sizeof(*byname) + 1);
+	n = 0;
+	for (item = items; item; item = item->next) {
+		if (!item->exact)
+			byname[n++] = item;
+	}
+	qsort(byname, n, sizeof(*byname), pathcmp);
+	for (item = items; item; item = next) {
+		struct item_t key = { .path = item->exact }, *kp = &key, **orig = NULL;
+
+		next = item->next;
+		if (item->exact)
+			orig = bsearch(&kp, byname, n, sizeof(*byname), pathcmp);
+		if (orig) {
+			item->next = (*orig)->copies;
+			(*orig)->copies = item;
+		} else {
+			*tail = item;
+			tail = &item->next;
+		}
+	}
+	*tail = NULL;
+	free(byname);
+	return head;
+}
+
 static void
-iorrcmp(struct item_t *items, struct item_t *refs) {
+iorrcmp(struct item_t *items, struct itemset *refs) {
+	struct itemset set;
+
 	if (!items)
 		return;
-	if (refs)
-		refcmp(items, refs);
+	/* --knn ranks copies among the neighbours, at 0 */
+	if (!knn)
+		items = split_copies(items);
+	itemset_init(&set, items);
+	if (knn) {
+		knncmp(&set, refs);
+	} else if (refs) {
+		itemset_reset(refs);
+		refcmp(&set, refs);
+	} else {
+		intracmp(&set);
+	}
+	itemset_free(&set);
+}
+
+/*
+ * Out-of-core mode.
+ *
+ * With the hashes split into threshold + 1 chunks, any two hashes
+ * within threshold are equal in at least one chunk. Records are
+ * written to a shard per chunk, picked by that chunk's value: once
+ * keyed by their base hash, to be indexed, and once per transform,
+ * to probe with. Every matching pair thus meets in some shard. Shards
+ * are then matched one at a time in memory, or in parallel within
+ * a memory budget, and pairs are merged into groups by union-find.
+ * Groups are therefore transitive, unlike the first-match groups of
+ * the in-memory modes.
+ */
+#define SHARD_MAXCHUNKS 8
+/* descriptors besides the shards: stdio, meta, paths, input, metrics */
+#define SHARD_SPAREFDS 16
+
+struct shent {
+	uint64_t hash;
+	uint32_t id;
+	uint32_t trans;		/* TI_LAST for a base hash to index */
+};
+
+struct shjob {
+	char path[PATH_MAX];
+	size_t size;
+	size_t cost;
+};
+
+static const char *sharddir = NULL;
+static int nshards = 64;
+static size_t shbudget = 0;
+static size_t shinuse = 0;
+static int shchunks;
+static FILE **shfp;
+static FILE *metafp;
+static FILE *pathfp;
+static uint64_t pathoff;
+static uint32_t nrecs;
+static uint32_t *ufparent;
+static pthread_mutex_t uflock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shcond = PTHREAD_COND_INITIALIZER;
+
+static void
+shard_path(char *buf, size_t len, const char *name, int i) {
+	if (i < 0)
+		snprintf(buf, len, "%s/%s", sharddir, name);
 	else
-		intracmp(items);
+		snprintf(buf, len, "%s/%s.%04d", sharddir, name, i);
+}
+
+static FILE *
+shard_fopen(const char *name, int i, const char *mode) {
+	char path[PATH_MAX];
+	FILE *fp;
+
+	shard_path(path, sizeof(path), name, i);
+	if (!(fp = fopen(path, mode)))
+		err(1, "fopen %s", path);
+	return fp;
+}
+
+/* every shard is open while records are written, raise the limit to that */
+static void
+shard_fdlimit(void) {
+	rlim_t need = (rlim_t)shchunks * nshards + SHARD_SPAREFDS;
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		err(1, "getrlimit");
+	if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= need)
+		return;
+	if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < need)
+		errx(1, "%d shards of %d chunks need %lu open files, the limit is %lu; lower -N",
+		     nshards, shchunks, (unsigned long)need, (unsigned long)rl.rlim_max);
+	rl.rlim_cur = need;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+		err(1, "setrlimit %lu open files", (unsigned long)need);
+}
+
+static void
+shard_open(void) {
+	if (threshold >= SHARD_MAXCHUNKS)
+		errx(1, "threshold %d too large to shard", threshold);
+	if (mkdir(sharddir, 0777) < 0 && errno != EEXIST)
+		err(1, "mkdir %s", sharddir);
+	shchunks = threshold + 1;
+	shard_fdlimit();
+	shfp = ecalloc(shchunks * nshards, sizeof(*shfp));
+	for (int i = 0; i < shchunks * nshards; ++i)
+		shfp[i] = shard_fopen("shard", i, "wb");
+	metafp = shard_fopen("meta", -1, "w+b");
+	pathfp = shard_fopen("paths", -1, "w+b");
+}
+
+static void
+shard_put(int c, uint64_t hash, uint32_t id, uint32_t trans) {
+	struct shent e = { .hash = hash, .id = id, .trans = trans };
+	int i = c * nshards + hindex_chunk(shchunks, hash, c) % nshards;
+
+	if (fwrite(&e, sizeof(e), 1, shfp[i]) != 1)
+		err(1, "write shard %d", i);
+}
+
+static void
+shard_add(struct item_t *item) {
+	static unsigned long nadded = 0;
+	size_t len = strlen(item->path) + 1;
+	struct refrec rec = {
+		.mtime = item->mtime,
+		.etime = item->etime,
+		.path = pathoff,
+		.w = item->w,
+		.h = item->h,
+		.size = item->size,
+	};
+	uint32_t id = nrecs++;
+
+	if (nrecs == NOIDX)
+		errx(1, "too many records");
+	memcpy(rec.hashes, item->hashes, sizeof(rec.hashes));
+	if (fwrite(&rec, sizeof(rec), 1, metafp) != 1
+	 || fwrite(item->path, len, 1, pathfp) != 1)
+		err(1, "write %s", sharddir);
+	pathoff += len;
+
+	for (int c = 0; c < shchunks; ++c) {
+		shard_put(c, item->hashes[TI_BASE], id, TI_LAST);
+		for (int t = 0; t < TI_LAST; ++t)
+			shard_put(c, item->hashes[t], id, t);
+	}
+
+	/* nothing refers to parsed items once they're on disk */
+	if (++nadded % 4096 == 0)
+		arena_free(&itemarena);
+}
+
+static uint32_t
+uf_find(uint32_t i) {
+	while (ufparent[i] != i) {
+		ufparent[i] = ufparent[ufparent[i]];
+		i = ufparent[i];
+	}
+	return i;
+}
+
+/* the smaller id becomes the root, so a group is headed by its first record */
+static void
+uf_union(uint32_t a, uint32_t b) {
+	a = uf_find(a);
+	b = uf_find(b);
+	if (a < b)
+		ufparent[b] = a;
+	else if (b < a)
+		ufparent[a] = b;
+}
+
+struct shmatch {
+	const uint32_t *ids;
+	uint32_t id;
+	uint32_t *pairs;
+	size_t npairs;
+	size_t cap;
+};
+
+static int
+shard_pair(void *ctx, uint32_t i, int d) {
+	struct shmatch *m = ctx;
+
+	if (m->ids[i] == m->id)
+		return 0;
+	if (m->npairs == m->cap) {
+		m->cap = m->cap ? 2 * m->cap : 1024;
+		m->pairs = erealloc(m->pairs, 2 * m->cap * sizeof(*m->pairs));
+	}
+	m->pairs[2 * m->npairs] = m->ids[i];
+	m->pairs[2 * m->npairs + 1] = m->id;
+	m->npairs++;
+	return 0;
+}
+
+static void
+shard_match(void *arg) {
+	struct shjob *job = arg;
+	size_t n = job->size / sizeof(struct shent);
+	struct shent *ents = emalloc(n * sizeof(*ents) + 1);
+	uint32_t *ids = emalloc(n * sizeof(*ids) + 1);
+	struct shmatch m = { .ids = ids };
+	struct hindex idx;
+	FILE *fp;
+
+	if (!(fp = fopen(job->path, "rb")) || fread(ents, sizeof(*ents), n, fp) != n)
+		err(1, "read %s", job->path);
+	fclose(fp);
+	unlink(job->path);
+
+	hindex_init(&idx, hindex_nchunks(threshold));
+	for (size_t i = 0; i < n; ++i) {
+		if (ents[i].trans == TI_LAST)
+			ids[hindex_add(&idx, ents[i].hash)] = ents[i].id;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (ents[i].trans == TI_LAST)
+			continue;
+		m.id = ents[i].id;
+		hindex_query(&idx, ents[i].hash, threshold, shard_pair, &m);
+	}
+	hindex_free(&idx);
+	free(ents);
+	free(ids);
+
+	pthread_mutex_lock(&uflock);
+	for (size_t i = 0; i < m.npairs; ++i)
+		uf_union(m.pairs[2 * i], m.pairs[2 * i + 1]);
+	shinuse -= job->cost;
+	pthread_cond_broadcast(&shcond);
+	pthread_mutex_unlock(&uflock);
+	free(m.pairs);
+}
+
+static void
+shard_print(const struct refrec *recs, const char *paths, uint32_t *next) {
+	static bool first = true;
+
+	for (uint32_t r = 0; r < nrecs; ++r) {
+		const struct refrec *ref = &recs[r];
+		struct item_t item;
+
+		if (ufparent[r] != r || next[r] == NOIDX)
+			continue;
+
+		if (jsondump)
+			fprintf(jfp, first ? "\t[" : ",[");
+		for (uint32_t i = r; i != NOIDX; i = next[i]) {
+			const struct refrec *rec = &recs[i];
+
+			if (!jsondump) {
+				fprintf(stdout, "%s\n", paths + rec->path);
+				continue;
+			}
+			item = (struct item_t){
+				.path = (char *)paths + rec->path,
+				.mtime = rec->mtime,
+				.etime = rec->etime,
+				.w = rec->w,
+				.h = rec->h,
+				.size = rec->size,
+				.eq_dist = -1,
+			};
+			memcpy(item.hashes, rec->hashes, sizeof(item.hashes));
+			if (i != r) {
+				item.eq_dist = 65;
+				for (size_t k = 0; k < TI_LAST; ++k) {
+					enum trans_t t = cmp_order[k];
+					int d = hdist(ref->hashes[TI_BASE], rec->hashes[t]);
+					if (d < item.eq_dist) {
+						item.eq_dist = d;
+						item.eq_trans = t;
+					}
+				}
+			}
+			fputjson(jfp, "\t\t", &item, i == r);
+		}
+		if (jsondump)
+			fprintf(jfp, "\n\t]");
+		first = false;
+	}
+}
+
+static void *
+shard_map(FILE *fp, size_t len) {
+	void *p;
+
+	if (fflush(fp))
+		err(1, "write %s", sharddir);
+	if (!len)
+		return NULL;
+	if ((p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) == MAP_FAILED)
+		err(1, "mmap");
+	return p;
+}
+
+static void
+shard_run(void) {
+	int nfiles = shchunks * nshards;
+	struct shjob *jobs = ecalloc(nfiles, sizeof(*jobs));
+	struct refrec *recs;
+	uint32_t *next;
+	char *paths;
+	char path[PATH_MAX];
+
+	for (int i = 0; i < nfiles; ++i) {
+		if (fclose(shfp[i]))
+			err(1, "write shard %d", i);
+	}
+	free(shfp);
+
+	ufparent = emalloc(nrecs * sizeof(*ufparent) + 1);
+	for (uint32_t i = 0; i < nrecs; ++i)
+		ufparent[i] = i;
+
+	if (nthreads > 1)
+		threads = thpool_init(nthreads);
+	for (int i = 0; i < nfiles; ++i) {
+		struct stat st;
+
+		shard_path(jobs[i].path, sizeof(jobs[i].path), "shard", i);
+		if (stat(jobs[i].path, &st) < 0)
+			err(1, "stat %s", jobs[i].path);
+		jobs[i].size = st.st_size;
+		/* entries, plus roughly as much again for the index */
+		jobs[i].cost = 2 * st.st_size;
+
+		pthread_mutex_lock(&uflock);
+		if (shbudget && jobs[i].cost > shbudget && verbose)
+			warnx("shard %d alone exceeds the memory budget", i);
+		while (shbudget && shinuse && shinuse + jobs[i].cost > shbudget)
+			pthread_cond_wait(&shcond, &uflock);
+		shinuse += jobs[i].cost;
+		pthread_mutex_unlock(&uflock);
+
+		if (threads)
+			thpool_add_work(threads, shard_match, &jobs[i]);
+		else
+			shard_match(&jobs[i]);
+	}
+	if (threads)
+		thpool_wait(threads);
+	free(jobs);
+
+	recs = shard_map(metafp, nrecs * sizeof(*recs));
+	paths = shard_map(pathfp, pathoff);
+	next = emalloc(nrecs * sizeof(*next) + 1);
+	for (uint32_t i = 0; i < nrecs; ++i)
+		next[i] = NOIDX;
+	/* a root precedes its members, so its own slot can head the list */
+	for (uint32_t i = nrecs; i-- > 0;) {
+		uint32_t r = uf_find(i);
+		if (r != i) {
+			next[i] = next[r];
+			next[r] = i;
+		}
+	}
+	shard_print(recs, paths, next);
+
+	if (recs)
+		munmap(recs, nrecs * sizeof(*recs));
+	if (paths)
+		munmap(paths, pathoff);
+	fclose(metafp);
+	fclose(pathfp);
+	shard_path(path, sizeof(path), "meta", -1);
+	unlink(path);
+	shard_path(path, sizeof(path), "paths", -1);
+	unlink(path);
+	free(next);
+	free(ufparent);
+}
+
+#define STREAM_MAXCONN 64
+
+struct conn {
+	int fd;
+	yajl_handle hand;
+	struct jstate js;
+};
+
+static const char *ckpath = NULL;
+static int ckinterval = 60;
+static time_t cktime;
+static bool ckdirty = false;
+static FILE *ckfp = NULL;
+static size_t cklogged;
+static volatile sig_atomic_t quit = 0;
+
+static void
+stream_add(struct item_t *item) {
+	static bool first = true;
+	uint32_t id, match;
+	struct item_t *ref;
+	struct item_t ev;
+
+	id = dedup_add(&sdd, item, &match);
+	ckdirty = true;
+	if (match == NOIDX || loading)
+		return;
+
+	ref = sdd.items[sdd.parent[id]];
+	if (jsondump) {
+		ev = *item;
+		ev.eq_trans = sdd.trans[id];
+		ev.eq_dist = hdist(ref->hashes[TI_BASE], item->hashes[ev.eq_trans]);
+		fprintf(jfp, first ? "\t[" : ",[");
+		fputjson(jfp, "\t\t", ref, true);
+		fputjson(jfp, "\t\t", &ev, false);
+		fprintf(jfp, "\n\t]");
+	} else {
+		fprintf(jfp, "%s\t%s\n", ref->path, item->path);
+	}
+	fflush(jfp);
+	first = false;
+}
+
+/*
+ * The checkpoint is a JSON array of the items in the order they were
+ * added, which replays into the same groups. Items are only ever added,
+ * so a checkpoint appends those since the last one to the array, left
+ * open until exit. It's rewritten whole only when opened, dropping a
+ * record torn by a crash and the bracket closing it, or after a failed
+ * append.
+ */
+static void
+ckopen(void) {
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int ret = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ckpath);
+	if (!(fp = fopen(tmp, "w"))) {
+		warn("fopen %s", tmp);
+		return;
+	}
+	fprintf(fp, "[");
+	for (size_t i = 0; i < sdd.n; ++i)
+		fputjson(fp, "\t", sdd.items[i], i == 0);
+	if (fflush(fp) || fsync(fileno(fp)) < 0)
+		ret = -1;
+	if (fclose(fp) || ret < 0) {
+		warn("write %s", tmp);
+		unlink(tmp);
+		return;
+	}
+	if (rename(tmp, ckpath) < 0) {
+		warn("rename %s", ckpath);
+		return;
+	}
+	if (!(ckfp = fopen(ckpath, "a"))) {
+		warn("fopen %s", ckpath);
+		return;
+	}
+	cklogged = sdd.n;
+}
+
+static void
+checkpoint(void) {
+	size_t n = sdd.n - cklogged;
+
+	cktime = time(NULL);
+	if (!ckfp) {
+		ckopen();
+		if (!ckfp)
+			return;
+	} else {
+		for (size_t i = cklogged; i < sdd.n; ++i)
+			fputjson(ckfp, "\t", sdd.items[i], i == 0);
+		if (fflush(ckfp) || fsync(fileno(ckfp)) < 0) {
+			warn("write %s", ckpath);
+			/* a record may be torn, so start over */
+			fclose(ckfp);
+			ckfp = NULL;
+			return;
+		}
+		cklogged = sdd.n;
+	}
+	ckdirty = false;
+	if (verbose > 1)
+		warnx("checkpointed %lu of %lu items to %s", n, sdd.n, ckpath);
+}
+
+/* the final checkpoint, closing the array */
+static void
+ckclose(void) {
+	if (ckdirty)
+		checkpoint();
+	if (!ckfp)
+		return;
+	fprintf(ckfp, "\n]\n");
+	if (fclose(ckfp))
+		warn("write %s", ckpath);
+	ckfp = NULL;
+}
+
+static void
+onsignal(int sig) {
+	quit = 1;
+}
+
+static int
+listen_unix(const char *path) {
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+		errx(1, "socket path too long: %s", path);
+	strcpy(sa.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		err(1, "bind %s", path);
+	if (listen(fd, 16) < 0)
+		err(1, "listen %s", path);
+	return fd;
+}
+
+static void
+conn_open(struct conn *c, int fd) {
+	c->fd = fd;
+	c->js = (struct jstate){ .arena = &itemarena };
+	c->hand = yajl_alloc(&jcb, NULL, &c->js);
+}
+
+static void
+conn_close(struct conn *c) {
+	yajl_complete_parse(c->hand);
+	yajl_free(c->hand);
+	if (c->fd != STDIN_FILENO)
+		close(c->fd);
+}
+
+/*
+ * Read records from stdin, or from clients connecting to the
+ * listening socket lfd, and report each new item that joins a group
+ * as soon as its record is complete.
+ */
+static void
+stream(int lfd) {
+	struct pollfd pfd[STREAM_MAXCONN + 1];
+	struct conn conns[STREAM_MAXCONN];
+	size_t nconn = 0;
+	uint8_t buf[4096];
+	struct sigaction sa = { .sa_handler = onsignal };
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (lfd < 0)
+		conn_open(&conns[nconn++], STDIN_FILENO);
+	cktime = time(NULL);
+
+	while (!quit && (lfd >= 0 || nconn)) {
+		int timeout = -1;
+		size_t np = 0;
+
+		if (ckpath && ckdirty) {
+			long left = cktime + ckinterval - time(NULL);
+			timeout = left > 0 ? left * 1000 : 0;
+		}
+		if (lfd >= 0)
+			pfd[np++] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+		for (size_t i = 0; i < nconn; ++i)
+			pfd[np++] = (struct pollfd){ .fd = conns[i].fd, .events = POLLIN };
+
+		if (poll(pfd, np, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		if (ckpath && ckdirty && time(NULL) >= cktime + ckinterval)
+			checkpoint();
+
+		np = 0;
+		if (lfd >= 0 && pfd[np++].revents) {
+			int fd = accept(lfd, NULL, NULL);
+			if (fd < 0) {
+				warn("accept");
+			} else if (nconn == STREAM_MAXCONN) {
+				warnx("too many connections");
+				close(fd);
+			} else {
+				conn_open(&conns[nconn++], fd);
+			}
+		}
+		/* walk backwards so closed connections can be swapped out */
+		for (size_t i = nconn; i-- > 0;) {
+			struct conn *c = &conns[i];
+			ssize_t rd;
+
+			if (!pfd[np + i].revents)
+				continue;
+			if ((rd = read(c->fd, buf, sizeof(buf))) > 0) {
+				if (yajl_parse(c->hand, buf, rd) == yajl_status_ok)
+					continue;
+				warnx("unable to parse json past %lu, dropping connection",
+				      yajl_get_bytes_consumed(c->hand));
+			} else if (rd < 0) {
+				if (errno == EINTR)
+					continue;
+				warn("read");
+			}
+			conn_close(c);
+			*c = conns[--nconn];
+		}
+	}
+
+	while (nconn)
+		conn_close(&conns[--nconn]);
+	if (ckpath)
+		ckclose();
 }
 
 int
@@ -343,8 +1461,12 @@ main(int argc, char *argv[]) {
 	struct optparse op;
 	long opt;
 	struct item_t *refitems = NULL;
+	struct itemset refset;
 	bool global = true;
 	bool from_stdin = false;
+	const char *sockpath = NULL;
+	const char *savepath = NULL;
+	bool refidx_loaded = false;
 
 	optparse_init(&op, argv);
 	while ((opt = optparse_long(&op, longopts, NULL)) != -1) {
@@ -370,11 +1492,62 @@ main(int argc, char *argv[]) {
 		case 'G':
 			global = false;
 			break;
+		case 's':
+			streaming = true;
+			break;
+		case 'S':
+			streaming = true;
+			sockpath = op.optarg;
+			break;
+		case 'C':
+			ckpath = op.optarg;
+			break;
+		case 'I':
+			ckinterval = atoi(op.optarg);
+			break;
 		case 'R':
+			if (refitems)
+				errx(1, "only one set of references");
+			if (is_refindex(op.optarg)) {
+				refitems = load_refs(op.optarg, &refidx_loaded);
+				break;
+			}
+			g_js.arena = &refarena;
 			read_file(op.optarg);
+			g_js.arena = &itemarena;
 			if (!(refitems = reset_head()))
 				errx(1, "no references in %s", op.optarg);
 			break;
+		case 'W':
+			savepath = op.optarg;
+			break;
+		case 'T':
+			nthreads = atoi(op.optarg);
+			break;
+		case 'k':
+			if ((knn = atoi(op.optarg)) < 1)
+				usage();
+			break;
+		case 'D':
+			sharding = true;
+			sharddir = op.optarg;
+			break;
+		case 'N':
+			if ((nshards = atoi(op.optarg)) < 1)
+				usage();
+			break;
+		case 'M':
+			shbudget = atol(op.optarg) * 1024 * 1024;
+			break;
+		case 'p':
+			progress.tty = true;
+			break;
+		case 'm':
+			progress.textfile = op.optarg;
+			break;
+		case 'e':
+			progress.interval = atoi(op.optarg);
+			break;
 		case '?':
 			warnx("%s", op.errmsg);
 			usage();
@@ -389,6 +1562,11 @@ main(int argc, char *argv[]) {
 	argv += op.optind;
 	argc -= op.optind;
 
+	if (verbose > 1)
+		warnx("popcount kernel: %s", popcnt_name());
+	hcount_on = progress.tty || progress.textfile;
+	progress_start(&progress);
+
 	if (dedup) {
 		jsondump = true;
 		int fd = mkstemp(jsonfile);
@@ -400,42 +1578,120 @@ main(int argc, char *argv[]) {
 		jfp = stdout;
 	}
 
+	if (streaming) {
+		int lfd = -1;
+
+		if (from_stdin || refitems)
+			usage();
+		dedup_init(&sdd, threshold);
+		loading = true;
+		if (ckpath && access(ckpath, F_OK) == 0)
+			read_file(ckpath);
+		for (int i = 0; i < argc; ++i)
+			read_file(argv[i]);
+		loading = false;
+		ckdirty = false;
+		if (ckpath)
+			ckopen();
+
+		if (sockpath)
+			lfd = listen_unix(sockpath);
+		if (jsondump)
+			fprintf(jfp, "[");
+		stream(lfd);
+		if (jsondump)
+			fprintf(jfp, "\n]\n");
+		if (lfd >= 0) {
+			close(lfd);
+			unlink(sockpath);
+		}
+		progress_stop(&progress);
+		dedup_free(&sdd);
+		arena_free(&itemarena);
+		return 0;
+	}
+
 	if (from_stdin == !!argc)
 		usage();
 
+	if (sharding) {
+		if (refitems || !global)
+			usage();
+		shard_open();
+		if (from_stdin)
+			parse_json(stdin, "stdin");
+		for (int i = 0; i < argc; ++i)
+			read_file(argv[i]);
+		if (jsondump)
+			fprintf(jfp, "[");
+		shard_run();
+		progress_stop(&progress);
+		if (jsondump)
+			fprintf(jfp, "\n]\n");
+		if (threads)
+			thpool_destroy(threads);
+		arena_free(&itemarena);
+		return 0;
+	}
+
+	if (refitems) {
+		itemset_init(&refset, refitems);
+		/* exact keys and base hashes don't mix */
+		if (refidx_loaded && !refidx.threshold != !threshold) {
+			matchidx_free(&refidx);
+			refidx_loaded = false;
+		}
+		if (!refidx_loaded) {
+			matchidx_init(&refidx, threshold);
+			for (size_t i = 0; i < refset.n; ++i)
+				matchidx_add(&refidx, refset.items[i]->hashes);
+		}
+		refidx.threshold = threshold;
+		if (savepath)
+			save_refs(savepath, &refset);
+	} else if (savepath) {
+		errx(1, "no references to save");
+	}
+	if ((refitems || knn) && nthreads > 1)
+		threads = thpool_init(nthreads);
+
 	if (jsondump)
 		fprintf(jfp, "[");
 
-
 	if (from_stdin) {
 		parse_json(stdin, "stdin");
-		iorrcmp(g_head, refitems);
-		free_items(g_head);
-		g_head = NULL;
+		iorrcmp(g_js.head, refitems ? &refset : NULL);
+		arena_free(&itemarena);
+		g_js.head = NULL;
 	}
 	if (global) {
 		for (int i = 0; i < argc; ++i) {
 			read_file(argv[i]);
 		}
-		iorrcmp(g_head, refitems);
+		iorrcmp(g_js.head, refitems ? &refset : NULL);
 	} else {
 		for (int i = 0; i < argc; ++i) {
 			read_file(argv[i]);
 			struct item_t *items = reset_head();
-			iorrcmp(items, refitems);
-			free_items(items);
+			iorrcmp(items, refitems ? &refset : NULL);
+			arena_free(&itemarena);
 		}
 	}
+	progress_stop(&progress);
 
 	if (jsondump)
 		fprintf(jfp, "\n]\n");
 	if (jfp != stdout)
 		fclose(jfp);
 	
-	if (refitems)
-		free_items(refitems);
-	if (g_head)
-		free_items(g_head);
+	if (refitems) {
+		itemset_free(&refset);
+		matchidx_free(&refidx);
+	}
+	if (threads)
+		thpool_destroy(threads);
+	arena_free(&refarena);
+	arena_free(&itemarena);
 
 	return 0;
 }
@@ -28,33 +28,279 @@
 #include <stdbool.h>
 #include <string.h>
 #include <err.h>
+#include <malloc.h>
 #include <pthread.h>
+#include <signal.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
-#include <libexif/exif-data.h>
 #include <turbojpeg.h>
 
 #include "_optparse.h"
 #include "thpool.h"
-#include "imgcode.h"
+#include "exif.h"
+#include "facedetect.h"
 #include "imgcmp.h"
+#include "phash.h"
+#include "planes.h"
+#include "popcnt.h"
+#include "progress.h"
+#include "stats.h"
+#include "trim.h"
 #include "util.h"
 
 static const char progname[] = "imghash";
 
 FILE *jfp;
 static bool jsondump = false;
+static bool dedup = false;
+static int threshold = 1;
+static struct dedup dd;
 
 struct item_t *head = NULL;
+static struct arena items;
+static size_t nitems = 0;
+static size_t nvalid = 0;
 static off_t maxbuf = 64 * 1024 * 1024;
 static int verbose = 1;
 static uint32_t transform = TRANS_NONE;
+static bool trim = false;
+static bool faces = false;
+static bool exact = false;
+
+/* the order of reads, and how many files ahead of them to hint */
+enum { L_NONE, L_INODE, L_EXTENT };
+static int layout = L_NONE;
+static int window = 8;
+static struct facenet *net;
 
 static int nthreads = 8;
 static threadpool threads;
 pthread_mutex_t prlock;
 pthread_mutex_t imlock;
+pthread_mutex_t facelock;
+
+enum stage_t {
+	S_QUEUE, S_READ, S_DIGEST, S_DECODE, S_IMLIB, S_SCALE, S_HASH, S_TRIM,
+	S_FACES, S_EXIF, S_OUTPUT, S_IMLOCK, S_PRLOCK, S_FACELOCK, S_MEMWAIT,
+	S_LAST,
+};
+
+static const char *stagename[S_LAST] = {
+	"queue", "read", "digest", "decode", "imlib", "scale", "hash", "trim",
+	"faces", "exif", "output", "imlock", "prlock", "facelock", "memwait",
+};
+
+/*
+ * Counters of one thread, linked into allstats on first use and kept
+ * until exit. Only their own thread writes them; a report sums them.
+ */
+struct wstats {
+	struct stage st[S_LAST];
+	uint64_t files, done, bytes, fallbacks, failed, copies;
+	struct wstats *next;
+};
+
+static bool stats = false;
+static bool statsreport = false;
+static const char *statsjson = NULL;
+static volatile sig_atomic_t statsreq = 0;
+static uint64_t tstart;
+static struct wstats *allstats;
+static pthread_mutex_t statlock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct wstats *mystats;
+
+static size_t membudget = 0;
+static size_t meminuse = 0;
+static pthread_mutex_t memlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t memcond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * An item and when it was queued. An exact copy of another job's file
+ * takes over its result, waiting on its list of copies until it is
+ * done.
+ */
+struct job {
+	struct item_t item;
+	uint64_t queued;
+	struct job *orig;
+	struct job *copies;
+	struct job *next;
+	bool done;
+	uint64_t key;
+	size_t seq;
+	struct job *ahead;
+};
+
+/*
+ * Jobs waiting to be sorted by where their files lie on disk, so that
+ * reads sweep across it instead of seeking back and forth.
+ */
+#define BATCH 4096
+static struct job *batch[BATCH];
+static size_t nbatch;
+
+/* the first job of each (dev, inode), or of each content digest */
+struct seen {
+	size_t mask, used;
+	struct seenent {
+		uint64_t a, b;
+		struct job *job;
+	} *e;
+};
+
+static struct seen inodes;
+static struct seen contents;
+static pthread_mutex_t duplock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct wstats *
+wstats(void) {
+	if (!mystats) {
+		mystats = ecalloc(1, sizeof(*mystats));
+		pthread_mutex_lock(&statlock);
+		mystats->next = allstats;
+		allstats = mystats;
+		pthread_mutex_unlock(&statlock);
+	}
+	return mystats;
+}
+
+static uint64_t
+tic(void) {
+	return stats ? nsnow() : 0;
+}
+
+/* account the time since t0 to stage s, return the current time */
+static uint64_t
+toc(enum stage_t s, uint64_t t0) {
+	uint64_t t;
+
+	if (!stats)
+		return 0;
+	t = nsnow();
+	stage_add(&wstats()->st[s], t - t0);
+	return t;
+}
+
+static void
+lock(pthread_mutex_t *m, enum stage_t s) {
+	uint64_t t0 = tic();
+	pthread_mutex_lock(m);
+	toc(s, t0);
+}
+
+static void
+sumstats(struct wstats *sum, bool stages) {
+	memset(sum, 0, sizeof(*sum));
+	pthread_mutex_lock(&statlock);
+	for (struct wstats *w = allstats; w; w = w->next) {
+		for (int i = 0; stages && i < S_LAST; ++i)
+			stage_merge(&sum->st[i], &w->st[i]);
+		sum->files += counter_get(&w->files);
+		sum->done += counter_get(&w->done);
+		sum->bytes += counter_get(&w->bytes);
+		sum->fallbacks += counter_get(&w->fallbacks);
+		sum->failed += counter_get(&w->failed);
+		sum->copies += counter_get(&w->copies);
+	}
+	pthread_mutex_unlock(&statlock);
+}
+
+static void
+report(void) {
+	double secs = (nsnow() - tstart) * 1e-9;
+	struct wstats sum;
+	FILE *fp;
+
+	sumstats(&sum, true);
+
+	fprintf(stderr, "%s: %lu files, %.1f MB in %.3f s (%.1f files/s, %.1f MB/s), "
+	        "%lu Imlib fallbacks, %lu exact copies, %lu failed\n", progname, sum.files,
+	        sum.bytes / 1e6, secs, sum.files / secs, sum.bytes / 1e6 / secs, sum.fallbacks,
+	        sum.copies, sum.failed);
+	for (int i = 0; i < S_LAST; ++i)
+		stage_fputs(stderr, stagename[i], &sum.st[i]);
+
+	if (!statsjson)
+		return;
+	if (!(fp = fopen(statsjson, "w"))) {
+		warn("fopen %s", statsjson);
+		return;
+	}
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"elapsed_s\":%.3f,\n", secs);
+	fprintf(fp, "\t\"threads\":%d,\n", nthreads);
+	fprintf(fp, "\t\"files\":%lu,\n", sum.files);
+	fprintf(fp, "\t\"bytes\":%lu,\n", sum.bytes);
+	fprintf(fp, "\t\"fallbacks\":%lu,\n", sum.fallbacks);
+	fprintf(fp, "\t\"failed\":%lu,\n", sum.failed);
+	fprintf(fp, "\t\"copies\":%lu,\n", sum.copies);
+	fprintf(fp, "\t\"stages\":{");
+	for (int i = 0; i < S_LAST; ++i)
+		stage_fputjson(fp, stagename[i], &sum.st[i], !i);
+	fprintf(fp, "\n\t}\n}\n");
+	if (fclose(fp))
+		warn("write %s", statsjson);
+}
+
+/* report from whichever thread notices a SIGUSR2 first */
+static void
+checkstats(void) {
+	if (statsreq && __atomic_exchange_n(&statsreq, 0, __ATOMIC_RELAXED))
+		report();
+}
+
+static void
+onusr2(int sig) {
+	statsreq = 1;
+}
+
+enum {
+	M_FOUND, M_QUEUED, M_DONE, M_BYTES, M_FAILED, M_FALLBACKS,
+	M_COPIES, M_BUSY, M_THREADS, M_COMPARED, M_LAST,
+};
+
+static struct pmetric metrics[M_LAST] = {
+	[M_FOUND]     = { "files_discovered", "Files found.", PM_COUNTER, "found" },
+	[M_QUEUED]    = { "files_queued", "Files waiting for a worker.", PM_GAUGE, "queued" },
+	[M_DONE]      = { "files_done", "Files processed.", PM_COUNTER, "done" },
+	[M_BYTES]     = { "read_bytes", "Bytes read.", PM_COUNTER, "bytes" },
+	[M_FAILED]    = { "errors", "Files that could not be hashed.", PM_COUNTER, "errors" },
+	[M_FALLBACKS] = { "imlib_fallbacks", "Files decoded by Imlib.", PM_COUNTER, NULL },
+	[M_COPIES]    = { "exact_copies", "Files found to be copies by --exact.", PM_COUNTER, NULL },
+	[M_BUSY]      = { "threads_busy", "Workers busy.", PM_GAUGE, "busy" },
+	[M_THREADS]   = { "threads", "Workers.", PM_GAUGE, NULL },
+	[M_COMPARED]  = { "comparisons", "Hash comparisons made by --dedup.", PM_COUNTER, NULL },
+};
+
+static void
+sample(struct pmetric *m, void *ctx) {
+	struct wstats sum;
+
+	sumstats(&sum, false);
+	m[M_FOUND].value = __atomic_load_n(&nitems, __ATOMIC_RELAXED);
+	m[M_QUEUED].value = m[M_FOUND].value - sum.files;
+	m[M_DONE].value = sum.done;
+	m[M_BYTES].value = sum.bytes;
+	m[M_FAILED].value = sum.failed;
+	m[M_FALLBACKS].value = sum.fallbacks;
+	m[M_COPIES].value = sum.copies;
+	m[M_BUSY].value = nthreads > 1 ? thpool_num_threads_working(threads) : sum.files > sum.done;
+	m[M_THREADS].value = nthreads;
+	m[M_COMPARED].value = __atomic_load_n(&hcount, __ATOMIC_RELAXED);
+}
+
+static struct progress progress = {
+	.prog = progname,
+	.interval = 15,
+	.m = metrics,
+	.n = M_LAST,
+	.sample = sample,
+};
 
 
 static void
@@ -68,43 +314,30 @@ prhash(const struct item_t *item, enum trans_t t) {
 	fprintf(stdout, "\n");
 }
 
-static int
-set_exif_date(struct item_t *item) {
-	ExifData *d = exif_data_new_from_data(item->data, item->size);
-	int ret = -1;
-
-	if (!d) {
-		return -1;
-	}
-	ExifEntry *e = NULL;
-
-	if (!e) e = exif_data_get_entry(d, EXIF_TAG_DATE_TIME_ORIGINAL);
-	if (!e) e = exif_data_get_entry(d, EXIF_TAG_DATE_TIME_DIGITIZED);
-	if (!e) e = exif_data_get_entry(d, EXIF_TAG_DATE_TIME);
-
-	if (e) {
-		char buf[24];
-		exif_entry_get_value(e, buf, sizeof(buf));
-		struct tm tm;
-
-		if (strptime(buf, "%Y:%m:%d %H:%M:%S", &tm)) {
-			item->etime = mktime(&tm);
-			ret = 0;
-		}
-	}
+static void
+set_exif(struct item_t *item) {
+	struct exifmeta m;
 
-	exif_data_unref(d);
-	return ret;
+	if (exif_scan(item->data, item->size, &m))
+		return;
+	item->etime = m.date;
+	item->orient = m.orient;
 }
 
 static void
-print_item(const struct item_t *item) {
-	pthread_mutex_lock(&prlock);
+print_item(struct item_t *item) {
 	static bool first = true;
+	uint64_t t;
 
 	if (!item->valid)
 		return;
-	if (jsondump) {
+	lock(&prlock, S_PRLOCK);
+	t = tic();
+	++nvalid;
+	if (dedup) {
+		/* matched against everything hashed so far */
+		dedup_add(&dd, item, NULL);
+	} else if (jsondump) {
 		fputjson(jfp, "\t", item, first);
 	} else {
 		prhash(item, TI_BASE);
@@ -123,163 +356,158 @@ print_item(const struct item_t *item) {
 		}
 	}
 	first = false;
+	toc(S_OUTPUT, t);
 	pthread_mutex_unlock(&prlock);
 }
 
-static const double DCT_O[] = { /* √(2/N) * cos(п / 2N * y * (2x + 1)) */
-	+0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000,
-	+0.490392640202, +0.415734806151, +0.277785116510, +0.097545161008, -0.097545161008, -0.277785116510, -0.415734806151, -0.490392640202,
-	+0.461939766256, +0.191341716183, -0.191341716183, -0.461939766256, -0.461939766256, -0.191341716183, +0.191341716183, +0.461939766256,
-	+0.415734806151, -0.097545161008, -0.490392640202, -0.277785116510, +0.277785116510, +0.490392640202, +0.097545161008, -0.415734806151,
-	+0.353553390593, -0.353553390593, -0.353553390593, +0.353553390593, +0.353553390593, -0.353553390593, -0.353553390593, +0.353553390593,
-	+0.277785116510, -0.490392640202, +0.097545161008, +0.415734806151, -0.415734806151, -0.097545161008, +0.490392640202, -0.277785116510,
-	+0.191341716183, -0.461939766256, +0.461939766256, -0.191341716183, -0.191341716183, +0.461939766256, -0.461939766256, +0.191341716183,
-	+0.097545161008, -0.277785116510, +0.415734806151, -0.490392640202, +0.490392640202, -0.415734806151, +0.277785116510, -0.097545161008,
-};
-static const double DCT_T[] = {
-	+0.500000000000, +0.490392640202, +0.461939766256, +0.415734806151, +0.353553390593, +0.277785116510, +0.191341716183, +0.097545161008,
-	+0.500000000000, +0.415734806151, +0.191341716183, -0.097545161008, -0.353553390593, -0.490392640202, -0.461939766256, -0.277785116510,
-	+0.500000000000, +0.277785116510, -0.191341716183, -0.490392640202, -0.353553390593, +0.097545161008, +0.461939766256, +0.415734806151,
-	+0.500000000000, +0.097545161008, -0.461939766256, -0.277785116510, +0.353553390593, +0.415734806151, -0.191341716183, -0.490392640202,
-	+0.500000000000, -0.097545161008, -0.461939766256, +0.277785116510, +0.353553390593, -0.415734806151, -0.191341716183, +0.490392640202,
-	+0.500000000000, -0.277785116510, -0.191341716183, +0.490392640202, -0.353553390593, -0.097545161008, +0.461939766256, -0.415734806151,
-	+0.500000000000, -0.415734806151, +0.191341716183, +0.097545161008, -0.353553390593, +0.490392640202, -0.461939766256, +0.277785116510,
-	+0.500000000000, -0.490392640202, +0.461939766256, -0.415734806151, +0.353553390593, -0.277785116510, +0.191341716183, -0.097545161008,
-};
+/*
+ * One decode for every analyzer. Without faces to find only the gray
+ * plane is needed, which turbojpeg gives fastest.
+ */
+static int
+decompress_item(struct item_t *item, struct planes *pl) {
+	int cmax = faces ? FACENET_SIZE : 0;
+	uint64_t t = tic();
+	int ret = 1;
+	tjhandle th;
+	int ss, cs;
 
-static void
-scale_down(double *dst, const uint8_t *src, int w, int h) {
-	int Dy = h / 8;
-	int Dx = w / 8;
-	int i = 0;
-
-	int X0 = (w % 8) / 2;
-	int Y0 = (h % 8) / 2;
-
-	for (int y0 = 0; y0 < 8; ++y0) {
-		for (int x0 = 0; x0 < 8; ++x0) {
-			double sum = 0.0;
-			for (int dy = 0; dy < Dy; ++dy)
-			for (int dx = 0; dx < Dx; ++dx) {
-				int row = Y0 + y0 * Dy + dy;
-				int col = X0 + x0 * Dx + dx;
-				sum += src[w * row + col];
-			}
-			dst[i++] = sum / (Dx * Dy);
-			
+	memset(pl, 0, sizeof(*pl));
+	if (cmax) {
+		ret = jpgplanes(item->data, item->size, cmax, pl);
+	} else {
+		if (!(th = tjInitDecompress())) {
+			errx(1, "Unable to initialize decompressor");
 		}
-	}
-}
-
-uint64_t
-genhash(double *ebe) {
-	uint64_t ret, bit;
-	double dct[64];
-	int i;
-
-	for (i = 0; i < 64; ++i)
-		dct[i] = 0.0;
-	for (int y = 0; y < 8; ++y) {
-		const double *dct_row = DCT_O + 8 * y;
-		double *ret_row = dct + 8 * y;
-		for (int x = 0; x < 8; ++x) {
-			const double *dct_col = DCT_T + 8 * x;
-			double tmp = 0.0;
-			for (i = 0; i < 8; ++i) {
-				tmp += dct_row[i] * ebe[x + i * 8];
-			}
-			for (i = 0; i < 8; ++i) {
-				ret_row[i] += dct_col[i] * tmp;
+		if (!tjDecompressHeader3(th, item->data, item->size, &pl->w, &pl->h, &ss, &cs)) {
+			pl->gray = emalloc(pl->w * pl->h * sizeof(*pl->gray));
+			ret = tjDecompress2(th, item->data, item->size, pl->gray, pl->w, 0, pl->h, TJPF_GRAY, 0) < 0;
+			if (ss >= 0) {
+				pl->xmod = tjMCUWidth[ss];
+				pl->ymod = tjMCUHeight[ss];
 			}
 		}
+		tjDestroy(th);
+		if (ret)
+			planes_free(pl);
 	}
+	toc(S_DECODE, t);
 
-	for (ret = 0, bit = 1, i = 0; i < 64; ++i, bit <<= 1) {
-		if (dct[i] > 0.0) {
-			ret |= bit;
-		}
+	if (ret) {
+		if (verbose > 1)
+			warnx("failed to decompress, trying Imlib %s", item->path);
+		if (stats)
+			counter_add(&wstats()->fallbacks, 1);
+		lock(&imlock, S_IMLOCK);
+		t = tic();
+		ret = imlibplanes(item->path, item->data, item->size, cmax, pl);
+		toc(S_IMLIB, t);
+		pthread_mutex_unlock(&imlock);
 	}
+	if (ret)
+		warnx("Failed to read image data: %s", item->path);
+	item->w = pl->w;
+	item->h = pl->h;
 	return ret;
 }
 
-static uint64_t
-hflip(double *dst, const double *src) {
-	const double *p = src;
-	for (int y = 0; y < 8; ++y) {
-		for (int x = 7; x >= 0; --x) {
-			dst[8 * y + x] = *p++;
-		}
-	}
-	return genhash(dst);
-}
-
-static uint64_t
-hrot1(double *dst, const double *src) {
-	const double *p = src;
-	for (int x = 7; x >= 0; --x) {
-		for (int y = 0; y < 8; ++y) {
-			dst[8 * y + x] = *p++;
-		}
+static void
+seen_grow(struct seen *s) {
+	struct seen old = *s;
+
+	s->mask = old.mask ? 2 * old.mask + 1 : 1023;
+	s->e = ecalloc(s->mask + 1, sizeof(*s->e));
+	for (size_t i = 0; old.e && i <= old.mask; ++i) {
+		size_t k;
+
+		if (!old.e[i].job)
+			continue;
+		for (k = old.e[i].a * 0x9e3779b97f4a7c15ULL >> 32 & s->mask; s->e[k].job; k = (k + 1) & s->mask);
+		s->e[k] = old.e[i];
 	}
-	return genhash(dst);
+	free(old.e);
 }
 
-static uint64_t
-hrot2(double *dst, const double *src) {
-	const double *p = src;
-	for (int y = 7; y >= 0; --y) {
-		for (int x = 7; x >= 0; --x) {
-			dst[8 * y + x] = *p++;
-		}
-	}
-	return genhash(dst);
-}
+/* the job first seen with key a, b, or NULL and job is that one now */
+static struct job *
+seen_claim(struct seen *s, uint64_t a, uint64_t b, struct job *job) {
+	size_t k;
 
-static uint64_t
-hrot3(double *dst, const double *src) {
-	const double *p = src;
-	for (int x = 0; x < 8; ++x) {
-		for (int y = 7; y >= 0; --y) {
-			dst[8 * y + x] = *p++;
-		}
+	if (2 * (s->used + 1) > s->mask + 1)
+		seen_grow(s);
+	for (k = a * 0x9e3779b97f4a7c15ULL >> 32 & s->mask; s->e[k].job; k = (k + 1) & s->mask) {
+		if (s->e[k].a == a && s->e[k].b == b)
+			return s->e[k].job;
 	}
-	return genhash(dst);
+	s->e[k] = (struct seenent){ a, b, job };
+	s->used++;
+	return NULL;
 }
 
-static uint8_t*
-decompress_item(struct item_t *item) {
-	uint8_t *data = NULL;
-	tjhandle th;
-	int ss, cs;
+static void settle(struct job*);
 
-	if (!(th = tjInitDecompress())) {
-		errx(1, "Unable to initialize decompressor");
-	}
-	if (!tjDecompressHeader3(th, item->data, item->size, &item->w, &item->h, &ss, &cs)) {
-		data = emalloc(item->w * item->h * sizeof(*data));
+/*
+ * An exact copy gets everything but its name and times, and passes it
+ * on to its own copies. It names the first file of them all.
+ */
+static void
+copy_result(struct job *job) {
+	struct item_t *item = &job->item;
+	const struct item_t *src = &job->orig->item;
+
+	item->exact = src->exact ? src->exact : src->path;
+	item->valid = src->valid;
+	item->w = src->w;
+	item->h = src->h;
+	item->etime = src->etime;
+	item->orient = src->orient;
+	memcpy(item->crop, src->crop, sizeof(item->crop));
+	item->nfaces = src->nfaces;
+	item->faces = src->faces;
+	memcpy(item->hashes, src->hashes, sizeof(item->hashes));
+	if (stats && !item->valid)
+		counter_add(&wstats()->failed, 1);
+	print_item(item);
+	settle(job);
+}
 
-		if (tjDecompress2(th, item->data, item->size, data, item->w, 0, item->h, TJPF_GRAY, 0) < 0) {
-			data = NULL;
-		}
+/* take over the result of orig, now or when it's done */
+static void
+copy_of(struct job *job, struct job *orig) {
+	bool done;
+
+	job->orig = orig;
+	if (stats)
+		counter_add(&wstats()->copies, 1);
+	pthread_mutex_lock(&duplock);
+	if (!(done = orig->done)) {
+		job->next = orig->copies;
+		orig->copies = job;
 	}
+	pthread_mutex_unlock(&duplock);
+	if (done)
+		copy_result(job);
+}
 
-	tjDestroy(th);
-
-	if (!data) {
-		if (verbose > 1)
-			warnx("failed to decompress, trying Imlib %s", item->path);
-		pthread_mutex_lock(&imlock);
-		data = imlib_grayscale(item->path, item->data, item->size, &item->w, &item->h);
-		pthread_mutex_unlock(&imlock);
+static void
+settle(struct job *job) {
+	struct job *c, *next;
+
+	pthread_mutex_lock(&duplock);
+	job->done = true;
+	c = job->copies;
+	job->copies = NULL;
+	pthread_mutex_unlock(&duplock);
+	for (; c; c = next) {
+		next = c->next;
+		copy_result(c);
 	}
-	if (!data)
-		warnx("Failed to read image data: %s", item->path);
-	return data;
 }
 
 static int
 read_item(struct item_t *item) {
 	FILE *fp = NULL;
+	uint64_t t = tic();
 		
 	if (!(fp = fopen(item->path, "rb")))
 		warn("fopen %s", item->path);
@@ -287,32 +515,122 @@ read_item(struct item_t *item) {
 	if (fread(item->data, item->size, 1, fp) != 1)
 		warn("fread %s %d", item->path, item->size);
 	fclose(fp);
+	toc(S_READ, t);
+	if (stats)
+		counter_add(&wstats()->bytes, item->size);
 	return item->data ? 0 : -1;
 }
 
+/* the box jpgtrim would crop to */
 static void
-handle_item(void *arg) {
+trim_item(struct item_t *item, const struct planes *pl) {
+	static const struct trimparm parm = TRIMPARM_DEFAULT;
+	uint64_t t = tic();
+	struct borders bd;
+
+	findborders(&parm, pl->gray, pl->w, pl->h, &bd);
+	if (hasborder(&parm, &bd)) {
+		int *c = item->crop;
+		if (!trimbox(&bd, pl->w, pl->h, pl->xmod, pl->ymod, c) || c[2] <= 0 || c[3] <= 0)
+			memset(c, 0, sizeof(item->crop));
+	}
+	toc(S_TRIM, t);
+}
+
+/* there is one net, and it isn't thread safe */
+static void
+face_item(struct item_t *item, const struct planes *pl) {
+	struct facebox *fb;
+	uint64_t t;
+	int n;
+
+	lock(&facelock, S_FACELOCK);
+	t = tic();
+	n = facenet_detect(net, pl->bgr, pl->cw, pl->ch, pl->w, pl->h, &fb);
+	toc(S_FACES, t);
+	pthread_mutex_unlock(&facelock);
+
+	if (n > 0) {
+		item->faces = emalloc(4 * n * sizeof(*item->faces));
+		for (int i = 0; i < n; ++i) {
+			item->faces[4 * i + 0] = fb[i].x;
+			item->faces[4 * i + 1] = fb[i].y;
+			item->faces[4 * i + 2] = fb[i].w;
+			item->faces[4 * i + 3] = fb[i].h;
+		}
+		item->nfaces = n;
+	}
+	free(fb);
+}
+
+/* analyzers run on the planes the hash was made from */
+static const struct {
+	bool *on;
+	void (*run)(struct item_t*, const struct planes*);
+} analyzers[] = {
+	{ &trim, trim_item },
+	{ &faces, face_item },
+};
+
+static void
+process_item(struct job *job) {
+	struct item_t *item = &job->item;
 	double ebe_base[64];
-	struct item_t *item = arg;
-	uint8_t *img;
+	struct planes pl;
+	uint64_t t;
 
 	if (read_item(item) < 0)
 		return;
-	if (!(img = decompress_item(item)))
+	if (exact) {
+		uint64_t d[2];
+		struct job *orig;
+
+		t = tic();
+		digest(item->data, item->size, d);
+		pthread_mutex_lock(&duplock);
+		orig = seen_claim(&contents, d[0], d[1] ^ item->size, job);
+		pthread_mutex_unlock(&duplock);
+		toc(S_DIGEST, t);
+		if (orig) {
+			free(item->data);
+			item->data = NULL;
+			copy_of(job, orig);
+			return;
+		}
+	}
+	if (decompress_item(item, &pl)) {
+		free(item->data);
+		item->data = NULL;
 		return;
+	}
 
-	scale_down(ebe_base, img, item->w, item->h);
-	free(img);
+	t = tic();
+	scale_down(ebe_base, pl.gray, item->w, item->h);
+	t = toc(S_SCALE, t);
 	item->valid = item->w >= 8 && item->h >= 8;
 
+	for (size_t i = 0; item->valid && i < sizeof(analyzers) / sizeof(*analyzers); ++i) {
+		if (*analyzers[i].on)
+			analyzers[i].run(item, &pl);
+	}
+	planes_free(&pl);
+	t = tic();
+
+	if (item->valid && jsondump) {
+		set_exif(item);
+		t = toc(S_EXIF, t);
+	}
+
+	/* the file buffer isn't needed beyond this point */
+	free(item->data);
+	item->data = NULL;
+
 	if (!item->valid) {
 		warnx("cannot handle %dx%d image %s", item->w, item->h, item->path);
 		return;
 	}
-
-	if (jsondump)
-		set_exif_date(item);
 	
+	t = tic();
 	item->hashes[TI_BASE] = genhash(ebe_base);
 	if (transform) {
 		double ebe_temp[64];
@@ -333,9 +651,207 @@ handle_item(void *arg) {
 			}
 		}
 	}
+	toc(S_HASH, t);
 	print_item(item);
 }
 
+static bool
+is_sof(int m) {
+	return m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc;
+}
+
+/* walk the markers up to the frame header, skipping the segments between */
+static int
+jpeg_dims(FILE *fp, int *w, int *h) {
+	uint8_t b[5];
+
+	if (fread(b, 2, 1, fp) != 1 || b[0] != 0xff || b[1] != 0xd8)
+		return -1;
+	for (;;) {
+		if (fread(b, 4, 1, fp) != 1 || b[0] != 0xff)
+			return -1;
+		if (is_sof(b[1])) {
+			if (fread(b, 5, 1, fp) != 1)
+				return -1;
+			*h = b[1] << 8 | b[2];
+			*w = b[3] << 8 | b[4];
+			return 0;
+		}
+		if ((b[2] << 8 | b[3]) < 2 || fseek(fp, (b[2] << 8 | b[3]) - 2, SEEK_CUR))
+			return -1;
+	}
+}
+
+static int
+png_dims(FILE *fp, int *w, int *h) {
+	static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	uint8_t b[24];
+
+	if (fread(b, sizeof(b), 1, fp) != 1 || memcmp(b, sig, sizeof(sig)) || memcmp(b + 12, "IHDR", 4))
+		return -1;
+	*w = b[16] << 24 | b[17] << 16 | b[18] << 8 | b[19];
+	*h = b[20] << 24 | b[21] << 16 | b[22] << 8 | b[23];
+	return 0;
+}
+
+/*
+ * Peak memory of hashing an item: the file buffer plus the decoded
+ * image, a byte a pixel from turbojpeg, or ARGB and then gray through
+ * Imlib, and the colour plane faces are found in. Anything without
+ * cheaply read dimensions is assumed to decode to ten times its size.
+ */
+static size_t
+estimate_cost(const struct item_t *item) {
+	size_t cost = item->size + 10 * (size_t)item->size;
+	int w, h;
+	FILE *fp;
+
+	if (!(fp = fopen(item->path, "rb")))
+		return cost;
+	if (!jpeg_dims(fp, &w, &h)) {
+		cost = item->size + (size_t)w * h;
+	} else {
+		rewind(fp);
+		if (!png_dims(fp, &w, &h) && w > 0 && h > 0)
+			cost = item->size + 5 * (size_t)w * h;
+	}
+	fclose(fp);
+	if (faces)
+		cost += 3 * FACENET_SIZE * FACENET_SIZE;
+	return cost;
+}
+
+/* a job larger than the whole budget runs alone */
+static void
+mem_reserve(size_t cost) {
+	uint64_t t = tic();
+
+	pthread_mutex_lock(&memlock);
+	while (meminuse && meminuse + cost > membudget)
+		pthread_cond_wait(&memcond, &memlock);
+	meminuse += cost;
+	pthread_mutex_unlock(&memlock);
+	toc(S_MEMWAIT, t);
+}
+
+static void
+mem_release(size_t cost) {
+	pthread_mutex_lock(&memlock);
+	meminuse -= cost;
+	pthread_cond_broadcast(&memcond);
+	pthread_mutex_unlock(&memlock);
+}
+
+/* have the kernel read a file ahead of its turn */
+static void
+prefetch(const struct job *job) {
+	int fd;
+
+	if ((fd = open(job->item.path, O_RDONLY)) < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+static void
+handle_item(void *arg) {
+	struct job *job = arg;
+	size_t cost = 0;
+
+	if (stats) {
+		toc(S_QUEUE, job->queued);
+		counter_add(&wstats()->files, 1);
+	}
+	if (job->ahead)
+		prefetch(job->ahead);
+	/* a hard link to a file seen before */
+	if (job->orig) {
+		copy_of(job, job->orig);
+		goto done;
+	}
+	if (membudget) {
+		cost = estimate_cost(&job->item);
+		mem_reserve(cost);
+	}
+	process_item(job);
+	if (membudget)
+		mem_release(cost);
+	if (job->orig)
+		goto done;
+	settle(job);
+	if (stats && !job->item.valid)
+		counter_add(&wstats()->failed, 1);
+done:
+	if (stats)
+		counter_add(&wstats()->done, 1);
+	checkstats();
+}
+
+static int
+queue(struct job *job) {
+	job->queued = tic();
+	if (nthreads > 1)
+		return thpool_add_work(threads, handle_item, job);
+	handle_item(job);
+	return 0;
+}
+
+/*
+ * Where a file starts on disk, from its first extent. Files FIEMAP
+ * can't tell about, or all with L_INODE, go by inode number instead;
+ * file systems tend to allocate those in order too.
+ */
+static uint64_t
+layout_key(const char *path, const struct stat *st) {
+	uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t)];
+	struct fiemap *fm = (struct fiemap *)buf;
+	uint64_t key = 1ULL << 63 | st->st_ino;
+	int fd;
+
+	if (layout != L_EXTENT || (fd = open(path, O_RDONLY)) < 0)
+		return key;
+	memset(buf, 0, sizeof(buf));
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+	if (!ioctl(fd, FS_IOC_FIEMAP, fm) && fm->fm_mapped_extents
+	 && !(fm->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+		key = fm->fm_extents[0].fe_physical;
+	close(fd);
+	return key;
+}
+
+static int
+keycmp(const void *a, const void *b) {
+	const struct job *x = *(struct job *const *)a;
+	const struct job *y = *(struct job *const *)b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Queue the batch in disk order. Each job hints the one window places
+ * after it as it starts, the first window jobs are hinted here, so
+ * the kernel reads a little ahead of the workers but not the whole
+ * batch at once.
+ */
+static int
+dispatch(void) {
+	int ret = 0;
+
+	qsort(batch, nbatch, sizeof(*batch), keycmp);
+	for (size_t i = 0; i < nbatch; ++i) {
+		batch[i]->ahead = window && i + window < nbatch ? batch[i + window] : NULL;
+		if (i < (size_t)window)
+			prefetch(batch[i]);
+	}
+	for (size_t i = 0; i < nbatch; ++i)
+		ret |= queue(batch[i]);
+	nbatch = 0;
+	return ret;
+}
+
 static int
 handle(const char *path) {
 	struct stat st;
@@ -366,20 +882,29 @@ handle(const char *path) {
 			return -1;
 		}
 
-		struct item_t *item = ecalloc(1, sizeof(*item));
-		item->path = strdup(path);
+		struct job *job = arena_alloc(&items, sizeof(*job));
+		struct item_t *item = &job->item;
+		item->path = arena_strdup(&items, path);
 		item->size = st.st_size;
 		item->mtime = st.st_mtime;
 		item->eq_trans = TI_LAST;
 		item->eq_dist = -1;
+		item->nfaces = 0;
+		if (exact)
+			job->orig = seen_claim(&inodes, st.st_dev, st.st_ino, job);
 
 		item->next = head;
 		head = item;
-
-		if (nthreads > 1) {
-			ret = thpool_add_work(threads, handle_item, item);
+		__atomic_store_n(&nitems, nitems + 1, __ATOMIC_RELAXED);
+
+		if (layout) {
+			job->key = layout_key(path, &st);
+			job->seq = nitems;
+			batch[nbatch++] = job;
+			if (nbatch == BATCH)
+				ret = dispatch();
 		} else {
-			handle_item(item);
+			ret = queue(job);
 		}
 	}
 	return ret;
@@ -398,6 +923,20 @@ static const struct optparse_long longopts[] = {
 	{ "flip",           'f', OPTPARSE_NONE },
 	{ "stdin",          'i', OPTPARSE_NONE },
 	{ "dedup",          'd', OPTPARSE_NONE },
+	{ "threshold",      'l', OPTPARSE_REQUIRED },
+	{ "stats",          'S', OPTPARSE_NONE },
+	{ "stats-json",     'J', OPTPARSE_REQUIRED },
+	{ "progress",       'p', OPTPARSE_NONE },
+	{ "metrics",        'm', OPTPARSE_REQUIRED },
+	{ "metrics-interval",'e', OPTPARSE_REQUIRED },
+	{ "memory-budget",  'B', OPTPARSE_REQUIRED },
+	{ "trim",           'C', OPTPARSE_NONE },
+	{ "faces",          'F', OPTPARSE_NONE },
+	{ "exact",          'X', OPTPARSE_NONE },
+	{ "layout",         'L', OPTPARSE_REQUIRED },
+	{ "readahead",      'A', OPTPARSE_REQUIRED },
+	{ "face-mpath",     'P', OPTPARSE_REQUIRED },
+	{ "face-dpath",     'D', OPTPARSE_REQUIRED },
 	{ "zsh-comp-gen", -3515, OPTPARSE_NONE },
 	{ 0 },
 };
@@ -411,13 +950,13 @@ usage() {
 
 int
 main(int argc, char **argv) {
-	char jsonfile[] = "/tmp/imghash-XXXXXX";
 	int ret = 0;
 	int i;
 	struct optparse op;
 	long opt;
 	bool from_stdin = false;
-	bool dedup = false;
+	const char *mpath = NULL;
+	const char *dpath = NULL;
 
 	optparse_init(&op, argv);
 	while ((opt = optparse_long(&op, longopts, NULL)) != -1) {
@@ -453,6 +992,56 @@ main(int argc, char **argv) {
 		case 'M':
 			maxbuf = atoi(op.optarg) * 1024 * 1024;
 			break;
+		case 'l':
+			threshold = atoi(op.optarg);
+			break;
+		case 'S':
+			stats = statsreport = true;
+			break;
+		case 'J':
+			stats = statsreport = true;
+			statsjson = op.optarg;
+			break;
+		case 'p':
+			stats = progress.tty = true;
+			break;
+		case 'm':
+			stats = true;
+			progress.textfile = op.optarg;
+			break;
+		case 'e':
+			progress.interval = atoi(op.optarg);
+			break;
+		case 'B':
+			membudget = atol(op.optarg) * 1024 * 1024;
+			break;
+		case 'C':
+			trim = true;
+			break;
+		case 'F':
+			faces = true;
+			break;
+		case 'X':
+			exact = true;
+			break;
+		case 'L':
+			if (!strcmp(op.optarg, "inode"))
+				layout = L_INODE;
+			else if (!strcmp(op.optarg, "extent"))
+				layout = L_EXTENT;
+			else
+				usage();
+			break;
+		case 'A':
+			if ((window = atoi(op.optarg)) < 0)
+				usage();
+			break;
+		case 'P':
+			mpath = op.optarg;
+			break;
+		case 'D':
+			dpath = op.optarg;
+			break;
 
 		case '?':
 			warnx("%s", op.errmsg);
@@ -464,24 +1053,41 @@ main(int argc, char **argv) {
 		}
 	}
 
+	jfp = stdout;
 	if (dedup) {
 		jsondump = true;
-		int fd = mkstemp(jsonfile);
-		if (fd < 0 || !(jfp = fdopen(fd, "w"))) {
-			err(1, "unable to get tempfile %s", jsonfile);
-		}
-		printf("Writing to tempfile %s\n", jsonfile);
-	} else {
-		jfp = stdout;
+		dedup_init(&dd, threshold);
 	}
 
+	/* their results only go into records */
+	if (trim || faces)
+		jsondump = true;
 	if (jsondump)
 		transform = ~TRANS_NONE;
+	if (faces && !(net = facenet_load(mpath, dpath, 0.7, 0.4)))
+		exit(1);
 
 	if (nthreads > 1)
 		threads = thpool_init(nthreads);
 	pthread_mutex_init(&prlock, NULL);
 	pthread_mutex_init(&imlock, NULL);
+	pthread_mutex_init(&facelock, NULL);
+	if (statsreport) {
+		/* restart, or a report would cut the stdin list short */
+		struct sigaction sa = { .sa_handler = onusr2, .sa_flags = SA_RESTART };
+
+		sigaction(SIGUSR2, &sa, NULL);
+	}
+	/*
+	 * glibc raises its mmap threshold as large blocks are freed, after
+	 * which they're kept in per-thread arenas and the budget no longer
+	 * bounds RSS. Pinning it returns decode buffers to the system.
+	 */
+	if (membudget)
+		mallopt(M_MMAP_THRESHOLD, 1024 * 1024);
+	tstart = nsnow();
+	hcount_on = dedup && (progress.tty || progress.textfile);
+	progress_start(&progress);
 
 	argv += op.optind;
 	argc -= op.optind;
@@ -489,7 +1095,7 @@ main(int argc, char **argv) {
 	if (!!argc == from_stdin)
 		usage();
 
-	if (jsondump)
+	if (jsondump && !dedup)
 		fprintf(jfp, "[");
 
 	if (from_stdin) {
@@ -508,30 +1114,35 @@ main(int argc, char **argv) {
 		}
 	}
 
+	if (nbatch)
+		ret |= dispatch();
 	if (nthreads > 1)
 		thpool_wait(threads);
+	progress_stop(&progress);
+	if (statsreport)
+		report();
 	
-	if (jsondump)
+	if (dedup) {
+		dedup_fputjson(jfp, &dd);
+		dedup_free(&dd);
+	} else if (jsondump) {
 		fprintf(jfp, "\n]\n");
-	if (jfp != stdout)
-		fclose(jfp);
+	}
 	
-	while (head) {
-		struct item_t *tmp = head->next;
-		if (!head->valid)
-			ret |= 1;
-		free(head->data);
-		free(head->path);
-		free(head);
-		head = tmp;
+	if (nvalid != nitems)
+		ret |= 1;
+	for (struct item_t *item = head; item; item = item->next) {
+		if (!item->exact)
+			free(item->faces);
 	}
+	free(inodes.e);
+	free(contents.e);
+	if (net)
+		facenet_free(net);
+	arena_free(&items);
+	head = NULL;
 	if (nthreads > 1)
 		thpool_destroy(threads);
 
-	if (dedup) {
-		execlp("imgdups", "imgdups", "-a", jsonfile, NULL);
-		return 127;
-	}
-
 	return ret;
 }
@@ -0,0 +1,222 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <jpeglib.h>
+
+#include "jpgborder.h"
+#include "jpgmem.h"
+#include "util.h"
+
+struct jerr {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+};
+
+struct scan {
+	struct jpeg_decompress_struct ci;
+	struct jerr jerr;
+	const uint8_t *buf;
+	size_t len;
+	uint8_t *data;
+	size_t cap;
+	size_t work;
+	size_t maxmem;
+	struct colstats cs;
+};
+
+static void
+jerr_exit(j_common_ptr ci) {
+	longjmp(((struct jerr *)ci->err)->env, 1);
+}
+
+/* warnings are ignored, as by tjDecompress2() */
+static void
+jerr_output(j_common_ptr ci) {
+}
+
+/*
+ * Entropy decode the whole file once into the coefficient buffer of
+ * buffered image mode; every strip is then an output pass of its own,
+ * doing only the IDCT of the rows and columns it reads.
+ */
+static void
+begin(struct scan *sc) {
+	jpeg_mem_src(&sc->ci, sc->buf, sc->len);
+	jpeg_read_header(&sc->ci, TRUE);
+	sc->ci.out_color_space = JCS_GRAYSCALE;
+	sc->ci.buffered_image = TRUE;
+	jpeg_start_decompress(&sc->ci);
+	for (;;) {
+		int r = jpeg_consume_input(&sc->ci);
+		if (r == JPEG_REACHED_EOI || r == JPEG_SUSPENDED)
+			break;
+	}
+}
+
+/*
+ * An output pass over columns [x, x + w), widened to whole iMCUs.
+ * Cropping narrows output_width for the passes that follow too, so it
+ * is reset first.
+ */
+static void
+start(struct scan *sc, JDIMENSION x, JDIMENSION w) {
+	jpeg_start_output(&sc->ci, sc->ci.input_scan_number);
+	sc->ci.output_width = sc->ci.image_width;
+	if (x || w < sc->ci.output_width)
+		jpeg_crop_scanline(&sc->ci, &x, &w);
+}
+
+static void
+restart(struct scan *sc, JDIMENSION x, JDIMENSION w) {
+	jpeg_finish_output(&sc->ci);
+	start(sc, x, w);
+}
+
+/*
+ * Rows [y0, y1) of the pass into sc->data, skipping any before. Strips
+ * larger than the memory limit give up, as errors do.
+ */
+static void
+rows(struct scan *sc, int y0, int y1) {
+	size_t stride = sc->ci.output_width;
+	size_t need = (size_t)(y1 - y0) * stride;
+
+	if (need > sc->maxmem)
+		longjmp(sc->jerr.env, 1);
+	if (need > sc->cap) {
+		sc->data = erealloc(sc->data, need);
+		sc->cap = need;
+	}
+	if ((JDIMENSION)y0 > sc->ci.output_scanline)
+		jpeg_skip_scanlines(&sc->ci, y0 - sc->ci.output_scanline);
+	while (sc->ci.output_scanline < (JDIMENSION)y1) {
+		JSAMPROW row = sc->data + (sc->ci.output_scanline - y0) * stride;
+		jpeg_read_scanlines(&sc->ci, &row, 1);
+	}
+	sc->work += need;
+}
+
+/*
+ * The bottom strip and the side bands start out an iMCU wide, the
+ * least an output pass decodes, and grow fourfold until their border
+ * ends inside them.
+ */
+static int
+scan(const struct trimparm *p, struct scan *sc, int w, int h, struct borders *bd) {
+	int half = h / 2;
+	int n, s, bw, y0, y1, cw, mw, mh;
+
+	begin(sc);
+	if ((int)sc->ci.image_width != w || (int)sc->ci.image_height != h)
+		return 1;
+	mw = sc->ci.max_h_samp_factor * sc->ci.min_DCT_scaled_size;
+	mh = sc->ci.max_v_samp_factor * sc->ci.min_DCT_scaled_size;
+	start(sc, 0, w);
+
+	/* top row by row, then the bottom in the same pass if it fits */
+	for (n = 0; n < half; ++n) {
+		rows(sc, n, n + 1);
+		if (rowborder(p, sc->data, w, 0, 1, +1) == p->margin)
+			break;
+	}
+	if (n == half)
+		return 1;
+	bd->t = p->margin + n;
+
+	/* the strip ends on the last, possibly partial, iMCU row */
+	for (s = h % mh ? h % mh : mh; ; s *= 4) {
+		if (s > h - half)
+			s = h - half;
+		rows(sc, h - s, h);
+		bd->b = rowborder(p, sc->data, w, s - 1, -1, -1);
+		if (bd->b - p->margin < s)
+			break;
+		if (s == h - half)
+			return 1;
+		restart(sc, 0, w);
+	}
+
+	/* the sides are searched between the top and bottom borders */
+	y0 = bd->t;
+	y1 = h - bd->b;
+	if (y0 >= y1 || w < 4)
+		return 1;
+
+	for (bw = mw; ; bw *= 4) {
+		if (bw > w / 2)
+			bw = w / 2;
+		restart(sc, 0, bw);
+		rows(sc, y0, y1);
+		cw = sc->ci.output_width;
+		if (cw >= w - 1)
+			return 1;
+		colstats(&sc->cs, sc->data, cw, cw, y1 - y0, y0);
+		bd->l = colborder(p, &sc->cs, 0, cw, +1);
+		if (bd->l - p->margin < cw)
+			break;
+		if (bw == w / 2)
+			return 1;
+	}
+
+	for (bw = mw; ; bw *= 4) {
+		if (bw > w / 2)
+			bw = w / 2;
+		restart(sc, w - bw, bw);
+		rows(sc, y0, y1);
+		cw = sc->ci.output_width;
+		colstats(&sc->cs, sc->data, cw, cw, y1 - y0, y0);
+		bd->r = colborder(p, &sc->cs, cw - 1, -1, -1);
+		if (bd->r - p->margin < cw)
+			break;
+		if (bw == w / 2)
+			return 1;
+	}
+	return 0;
+}
+
+int
+jpgborders(const struct trimparm *p, const uint8_t *buf, size_t len, int w, int h, size_t maxmem,
+           struct borders *bd, size_t *work) {
+	/* on the heap, as it's changed between setjmp() and longjmp() */
+	struct scan *sc = ecalloc(1, sizeof(*sc));
+	int ret = 1;
+
+	sc->buf = buf;
+	sc->len = len;
+	sc->maxmem = maxmem;
+	sc->ci.err = jpeg_std_error(&sc->jerr.pub);
+	sc->jerr.pub.error_exit = jerr_exit;
+	sc->jerr.pub.output_message = jerr_output;
+	jpeg_create_decompress(&sc->ci);
+	jpgmem((j_common_ptr)&sc->ci, maxmem);
+	if (!setjmp(sc->jerr.env))
+		ret = scan(p, sc, w, h, bd);
+	*work = sc->work;
+	jpeg_destroy_decompress(&sc->ci);
+	free(sc->data);
+	colstats_free(&sc->cs);
+	free(sc);
+	return ret;
+}
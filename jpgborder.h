@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trim.h"
+
+/*
+ * findborders() on a w x h JPEG, transforming only strips along its
+ * edges back to pixels: rows from the top and a strip at the bottom,
+ * then column bands between those borders for the left and right.
+ * Strips grow until each border ends inside one. The file is still
+ * entropy decoded in full, once; its coefficients, like the strips,
+ * are kept within maxmem bytes (see jpgmem.h).
+ *
+ * Returns 0 with the borders, or 1 when the whole image should be
+ * decoded instead: when a border reaches the middle, a strip would
+ * exceed maxmem, and on errors.
+ * *work is the number of pixels decoded either way.
+ */
+int jpgborders(const struct trimparm*, const uint8_t*, size_t, int w, int h, size_t maxmem,
+               struct borders*, size_t *work);
@@ -0,0 +1,164 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "jpgcrop.h"
+#include "jpgmem.h"
+#include "util.h"
+
+struct jerr {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+};
+
+struct crop {
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct jerr jerr;
+	jvirt_barray_ptr arrays[MAX_COMPONENTS];
+};
+
+static void
+jerr_exit(j_common_ptr ci) {
+	longjmp(((struct jerr *)ci->err)->env, 1);
+}
+
+static void
+jerr_output(j_common_ptr ci) {
+}
+
+static JDIMENSION
+blocks(int n, int samp, int maxsamp) {
+	return ((JDIMENSION)n * samp + maxsamp * DCTSIZE - 1) / (maxsamp * DCTSIZE);
+}
+
+static JDIMENSION
+roundup(JDIMENSION n, int m) {
+	return (n + m - 1) / m * m;
+}
+
+/*
+ * Markers are saved while reading and written after the frame header,
+ * except those libjpeg writes itself, as jpegtran does.
+ */
+static void
+copymarkers(struct crop *c) {
+	for (jpeg_saved_marker_ptr mk = c->src.marker_list; mk; mk = mk->next) {
+		if (c->dst.write_JFIF_header && mk->marker == JPEG_APP0 &&
+		    mk->data_length >= 5 && !memcmp(mk->data, "JFIF", 5))
+			continue;
+		if (c->dst.write_Adobe_marker && mk->marker == JPEG_APP0 + 14 &&
+		    mk->data_length >= 5 && !memcmp(mk->data, "Adobe", 5))
+			continue;
+		jpeg_write_marker(&c->dst, mk->marker, mk->data, mk->data_length);
+	}
+}
+
+/*
+ * The cropped arrays are requested from the source object, so they are
+ * realized, and kept within maxmem, together with the source's own.
+ * Returns 1, before anything is written, for a box that is off the
+ * iMCU grid or not inside the image.
+ */
+static int
+transcode(struct crop *c, const uint8_t *buf, size_t len, FILE *out, int x, int y, int w, int h) {
+	jvirt_barray_ptr *src;
+	int mw, mh;
+
+	jpeg_mem_src(&c->src, buf, len);
+	jpeg_save_markers(&c->src, JPEG_COM, 0xffff);
+	for (int i = 0; i < 16; ++i)
+		jpeg_save_markers(&c->src, JPEG_APP0 + i, 0xffff);
+	jpeg_read_header(&c->src, TRUE);
+	mw = c->src.max_h_samp_factor * DCTSIZE;
+	mh = c->src.max_v_samp_factor * DCTSIZE;
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 || x % mw || y % mh ||
+	    (JDIMENSION)x > c->src.image_width || (JDIMENSION)w > c->src.image_width - x ||
+	    (JDIMENSION)y > c->src.image_height || (JDIMENSION)h > c->src.image_height - y)
+		return 1;
+	for (int ci = 0; ci < c->src.num_components; ++ci) {
+		jpeg_component_info *comp = &c->src.comp_info[ci];
+		JDIMENSION bw = blocks(w, comp->h_samp_factor, c->src.max_h_samp_factor);
+		JDIMENSION bh = blocks(h, comp->v_samp_factor, c->src.max_v_samp_factor);
+
+		/* the source arrays are padded to whole iMCUs too */
+		if (x / mw * comp->h_samp_factor + roundup(bw, comp->h_samp_factor) >
+		        roundup(comp->width_in_blocks, comp->h_samp_factor) ||
+		    y / mh * comp->v_samp_factor + roundup(bh, comp->v_samp_factor) >
+		        roundup(comp->height_in_blocks, comp->v_samp_factor))
+			return 1;
+		c->arrays[ci] = c->src.mem->request_virt_barray((j_common_ptr)&c->src, JPOOL_IMAGE, TRUE,
+		        roundup(bw, comp->h_samp_factor), roundup(bh, comp->v_samp_factor), comp->v_samp_factor);
+	}
+	src = jpeg_read_coefficients(&c->src);
+
+	jpeg_copy_critical_parameters(&c->src, &c->dst);
+	c->dst.image_width = w;
+	c->dst.image_height = h;
+	jpeg_stdio_dest(&c->dst, out);
+	jpeg_write_coefficients(&c->dst, c->arrays);
+	copymarkers(c);
+
+	for (int ci = 0; ci < c->dst.num_components; ++ci) {
+		jpeg_component_info *comp = &c->dst.comp_info[ci];
+		JDIMENSION bx = x / mw * comp->h_samp_factor;
+		JDIMENSION by = y / mh * comp->v_samp_factor;
+		int v = comp->v_samp_factor;
+
+		for (JDIMENSION r = 0; r < comp->height_in_blocks; r += v) {
+			JBLOCKARRAY d = c->src.mem->access_virt_barray((j_common_ptr)&c->src, c->arrays[ci], r, v, TRUE);
+			JBLOCKARRAY s = c->src.mem->access_virt_barray((j_common_ptr)&c->src, src[ci], by + r, v, FALSE);
+			for (int k = 0; k < v; ++k)
+				memcpy(d[k], s[k] + bx, comp->width_in_blocks * sizeof(JBLOCK));
+		}
+	}
+	jpeg_finish_compress(&c->dst);
+	jpeg_finish_decompress(&c->src);
+	return 0;
+}
+
+int
+jpgcrop(const uint8_t *buf, size_t len, FILE *out, int x, int y, int w, int h, size_t maxmem) {
+	/* on the heap, as it's changed between setjmp() and longjmp() */
+	struct crop *c = ecalloc(1, sizeof(*c));
+	int ret = 1;
+
+	c->src.err = c->dst.err = jpeg_std_error(&c->jerr.pub);
+	c->jerr.pub.error_exit = jerr_exit;
+	c->jerr.pub.output_message = jerr_output;
+	jpeg_create_decompress(&c->src);
+	jpgmem((j_common_ptr)&c->src, maxmem);
+	jpeg_create_compress(&c->dst);
+	jpgmem((j_common_ptr)&c->dst, maxmem);
+	if (!setjmp(c->jerr.env)) {
+		ret = transcode(c, buf, len, out, x, y, w, h);
+	}
+	jpeg_destroy_compress(&c->dst);
+	jpeg_destroy_decompress(&c->src);
+	free(c);
+	return ret;
+}
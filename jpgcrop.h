@@ -0,0 +1,12 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lossless crop of a JPEG to the box at x, y, both multiples of the
+ * iMCU size, written to the file as it is encoded. Coefficients are
+ * kept within maxmem bytes, the rest in temporary files; markers are
+ * copied. Returns 0 on success.
+ */
+int jpgcrop(const uint8_t*, size_t, FILE*, int x, int y, int w, int h, size_t maxmem);
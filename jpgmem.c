@@ -0,0 +1,185 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "jpgmem.h"
+#include "util.h"
+
+/* opaque in jpeglib.h, so each memory manager defines its own */
+struct jvirt_barray_control {
+	JDIMENSION rows;
+	JDIMENSION maxaccess;
+	size_t rowlen;		/* bytes */
+	JDIMENSION inmem;	/* rows of the window */
+	JDIMENSION first;	/* row at the start of the window */
+	boolean dirty;
+	JBLOCKROW buf;
+	JBLOCKARRAY rowp;
+	FILE *fp;		/* NULL when the window is the whole array */
+	struct jvirt_barray_control *next;
+};
+
+struct jmem {
+	struct jpeg_memory_mgr orig;
+	size_t limit;
+	jvirt_barray_ptr arrays;
+};
+
+static jvirt_barray_ptr
+request(j_common_ptr ci, int pool, boolean pre_zero, JDIMENSION cols, JDIMENSION rows, JDIMENSION maxaccess) {
+	struct jmem *m = ci->client_data;
+	jvirt_barray_ptr a;
+
+	if (pool != JPOOL_IMAGE)
+		ERREXIT1(ci, JERR_BAD_POOL_ID, pool);
+	a = m->orig.alloc_small(ci, pool, sizeof(*a));
+	memset(a, 0, sizeof(*a));
+	a->rows = rows;
+	a->maxaccess = maxaccess;
+	a->rowlen = (size_t)cols * sizeof(JBLOCK);
+	a->next = m->arrays;
+	m->arrays = a;
+	return a;
+}
+
+/*
+ * Arrays are zeroed whether asked to or not: calloc() when they fit,
+ * or a sparse file. Windows are as many maxaccess rows as the limit
+ * allows for every array at once, as in libjpeg's own backing store.
+ */
+static void
+realize(j_common_ptr ci) {
+	struct jmem *m = ci->client_data;
+	size_t total = 0, least = 0, n = 0;
+	jvirt_barray_ptr a;
+
+	for (a = m->arrays; a; a = a->next) {
+		if (a->buf)
+			continue;
+		total += a->rows * a->rowlen;
+		least += a->maxaccess * a->rowlen;
+	}
+	if (total > m->limit)
+		n = least < m->limit ? m->limit / least : 1;
+	for (a = m->arrays; a; a = a->next) {
+		if (a->buf)
+			continue;
+		a->inmem = a->rows;
+		if (total > m->limit && n * a->maxaccess < a->rows) {
+			a->inmem = n * a->maxaccess;
+			if (!(a->fp = tmpfile()))
+				ERREXITS(ci, JERR_TFILE_CREATE, "");
+			if (ftruncate(fileno(a->fp), a->rows * a->rowlen) < 0)
+				ERREXIT(ci, JERR_TFILE_WRITE);
+		}
+		if (!(a->buf = calloc(a->inmem, a->rowlen)))
+			ERREXIT1(ci, JERR_OUT_OF_MEMORY, 10);
+		a->rowp = m->orig.alloc_small(ci, JPOOL_IMAGE, a->inmem * sizeof(*a->rowp));
+		for (JDIMENSION r = 0; r < a->inmem; ++r)
+			a->rowp[r] = (JBLOCKROW)((char *)a->buf + r * a->rowlen);
+	}
+	m->orig.realize_virt_arrays(ci);
+}
+
+static void
+window(j_common_ptr ci, jvirt_barray_ptr a, boolean store) {
+	JDIMENSION n = a->rows - a->first < a->inmem ? a->rows - a->first : a->inmem;
+	size_t len = n * a->rowlen;
+	off_t off = (off_t)a->first * a->rowlen;
+
+	if (store && pwrite(fileno(a->fp), a->buf, len, off) != (ssize_t)len)
+		ERREXIT(ci, JERR_TFILE_WRITE);
+	if (!store && pread(fileno(a->fp), a->buf, len, off) != (ssize_t)len)
+		ERREXIT(ci, JERR_TFILE_READ);
+}
+
+/* the window moves to start at start_row, or end at its end going back */
+static JBLOCKARRAY
+fetch(j_common_ptr ci, jvirt_barray_ptr a, JDIMENSION start, JDIMENSION n, boolean writable) {
+	JDIMENSION end = start + n;
+
+	if (end > a->rows || n > a->maxaccess || !a->buf)
+		ERREXIT(ci, JERR_BAD_VIRTUAL_ACCESS);
+	if (start < a->first || end > a->first + a->inmem) {
+		if (a->dirty)
+			window(ci, a, TRUE);
+		a->dirty = FALSE;
+		if (start > a->first)
+			a->first = start;
+		else
+			a->first = end > a->inmem ? end - a->inmem : 0;
+		window(ci, a, FALSE);
+	}
+	if (writable)
+		a->dirty = TRUE;
+	return a->rowp + (start - a->first);
+}
+
+static void
+release(struct jmem *m) {
+	for (jvirt_barray_ptr a = m->arrays; a; a = a->next) {
+		if (a->fp)
+			fclose(a->fp);
+		free(a->buf);
+	}
+	m->arrays = NULL;
+}
+
+static void
+free_pool(j_common_ptr ci, int pool) {
+	struct jmem *m = ci->client_data;
+
+	if (pool == JPOOL_IMAGE)
+		release(m);
+	m->orig.free_pool(ci, pool);
+}
+
+static void
+self_destruct(j_common_ptr ci) {
+	struct jmem *m = ci->client_data;
+
+	release(m);
+	m->orig.self_destruct(ci);
+	ci->client_data = NULL;
+	free(m);
+}
+
+void
+jpgmem(j_common_ptr ci, size_t limit) {
+	struct jmem *m = ecalloc(1, sizeof(*m));
+
+	m->orig = *ci->mem;
+	m->limit = limit;
+	ci->client_data = m;
+	ci->mem->max_memory_to_use = limit;
+	ci->mem->request_virt_barray = request;
+	ci->mem->realize_virt_arrays = realize;
+	ci->mem->access_virt_barray = fetch;
+	ci->mem->free_pool = free_pool;
+	ci->mem->self_destruct = self_destruct;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <jpeglib.h>
+
+/*
+ * Coefficient arrays of a libjpeg object within a memory limit.
+ *
+ * Buffered image mode and lossless transforms keep the coefficients of
+ * the whole image, and libjpeg-turbo has no backing store for them.
+ * jpgmem() takes over the block arrays of an object: when all of them
+ * fit in limit bytes they stay in memory, otherwise each is kept in a
+ * temporary file with only a window of rows in memory.
+ *
+ * Call right after jpeg_create_*(). The object's client_data is used.
+ * Arrays of one object may be accessed through another using jpgmem().
+ */
+void jpgmem(j_common_ptr, size_t limit);
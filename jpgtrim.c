@@ -21,26 +21,93 @@
  */
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <turbojpeg.h>
 #include <string.h>
+#include <pthread.h>
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <yajl/yajl_parse.h>
 
 #include "_optparse.h"
+#include "jpgborder.h"
+#include "jpgcrop.h"
+#include "pngtrim.h"
+#include "thpool.h"
+#include "trim.h"
 #include "util.h"
+#include "webptrim.h"
 
 static const char progname[] = "jpgtrim";
 static int verbose = 1;
-static int threshold = 26;
-static int gradient = 10;
-static int margin = 4;
+static struct trimparm parm = TRIMPARM_DEFAULT;
 static bool clobber = false;
 static bool dry_run = false;
+static bool full_decode = false;
 static const char default_oldext[] = ".0ld";
 static const char *oldext = default_oldext;
+static int nthreads = 8;
+static size_t maxmem = (size_t)512 << 20;
+static threadpool threads;
+static pthread_mutex_t prlock = PTHREAD_MUTEX_INITIALIZER;
+static int status = 0;
+static const char *planpath = NULL;
+static const char *applypath = NULL;
+static FILE *planfp = NULL;
+static bool planfirst = true;
+
+/* formats other than JPEG, all decoded whole and cropped exactly */
+struct exact {
+	int (*is)(const uint8_t*, size_t);
+	int (*size)(const uint8_t*, size_t, int*, int*);
+	int (*gray)(const uint8_t*, size_t, uint8_t**, size_t*, int*, int*);
+	int (*crop)(const uint8_t*, size_t, FILE*, int, int, int, int);
+};
+
+static const struct exact exacts[] = {
+	{ ispng,  pngsize,  pnggray,  pngcrop },
+	{ iswebp, webpsize, webpgray, webpcrop },
+};
+
+/* a crop of a plan, and the file it was planned for */
+struct planent {
+	char *path;
+	long size;
+	long mtime;
+	long mtime_nsec;
+	int x, y, w, h;
+};
+
+/* plan parser state, passed to the callbacks as context */
+struct jstate {
+	struct planent *ent;
+	char key[16];
+};
+
+/*
+ * Turbojpeg handles and buffers of a thread, kept from one file to
+ * the next and released at exit.
+ */
+struct worker {
+	tjhandle dec;
+	tjhandle xf;
+	uint8_t *src;
+	size_t srccap;
+	uint8_t *data;
+	size_t datacap;
+	struct worker *next;
+};
+
+static struct worker *workers;
+static pthread_mutex_t wlock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct worker *self;
 
 static const struct optparse_long longopts[] = {
 	{ "clobber",       'f', OPTPARSE_NONE },
@@ -51,6 +118,13 @@ static const struct optparse_long longopts[] = {
 	{ "gradient",      'g', OPTPARSE_REQUIRED },
 	{ "margin",        'm', OPTPARSE_REQUIRED },
 	{ "oldsuffix",     'o', OPTPARSE_REQUIRED },
+	{ "threads",       'T', OPTPARSE_REQUIRED },
+	{ "stdin",         'i', OPTPARSE_NONE },
+	{ "null",          '0', OPTPARSE_NONE },
+	{ "full-decode",   'F', OPTPARSE_NONE },
+	{ "memory",        'M', OPTPARSE_REQUIRED },
+	{ "plan",          'P', OPTPARSE_REQUIRED },
+	{ "apply",         'A', OPTPARSE_REQUIRED },
 	{ "help",          'h', OPTPARSE_NONE },
 	{ "zsh-comp-gen", -3515, OPTPARSE_NONE },
 	{ 0 },
@@ -62,18 +136,29 @@ help(void) {
 	printf(" -f\tOverwrite files\n");
 	printf(" -v|-q\tChange verbosity\n");
 	printf(" -o S\tBackup suffix when not clobbering (%s)\n", default_oldext);
-	printf(" -t T\tThreshold [0, 255] (%d)\n", threshold);
+	printf(" -T N\tWorker threads (%d)\n", nthreads);
+	printf(" -i\tRead file names from stdin, one per line\n");
+	printf(" -0\tFile names on stdin are NUL separated\n");
+	printf(" -F\tDecode whole images, not just strips at the edges\n");
+	printf(" -M N\tMemory limit of a thread in MiB (%zu). Larger\n", maxmem >> 20);
+	printf("\tJPEGs are scanned and cropped through temporary\n");
+	printf("\tfiles, and never decoded whole.\n");
+	printf(" -P F\tWrite the crops to plan F as JSON, cropping nothing\n");
+	printf(" -A F\tCrop as planned in F, - for stdin, without decoding.\n");
+	printf("\tFiles changed since are skipped.\n");
+	printf(" -t T\tThreshold [0, 255] (%d)\n", parm.threshold);
 	printf("\tMinimum luminosity difference within a line\n");
 	printf("\tfor it to not be considered a border.\n");
-	printf(" -g G\tGradient threshold [0, 255] (%d)\n", gradient);
+	printf(" -g G\tGradient threshold [0, 255] (%d)\n", parm.gradient);
 	printf("\tMaximium luminosity difference betweed ajacent\n");
 	printf("\tpixels within a border line.\n");
-	printf(" -m M\tMargin [0, max(w,h)] (%d)\n", margin);
+	printf(" -m M\tMargin [0, max(w,h)] (%d)\n", parm.margin);
 	printf("\tEdges determined to be borders will be cropped\n");
 	printf("\tby this many pixels beyond the computed border.\n");
-	printf("\tImages will always be cropped to an integer\n");
-	printf("\tmultiple of the file's JPEG block size.\n");
-	printf("\tOnly jpg, others: gm convert -fuzz 90%% -trim\n");
+	printf("\tJPEGs will always be cropped to an integer\n");
+	printf("\tmultiple of the file's JPEG block size,\n");
+	printf("\tPNGs and WebPs are cropped exactly.\n");
+	printf("\tOthers: gm convert -fuzz 90%% -trim\n");
 }
 
 static void
@@ -83,45 +168,183 @@ usage(void) {
 	exit(1);
 }
 
+static struct worker *
+worker(void) {
+	if (!self) {
+		self = ecalloc(1, sizeof(*self));
+		if (!(self->dec = tjInitDecompress()) || !(self->xf = tjInitTransform()))
+			errx(1, "Unable to initialize");
+		pthread_mutex_lock(&wlock);
+		self->next = workers;
+		workers = self;
+		pthread_mutex_unlock(&wlock);
+	}
+	return self;
+}
+
+static void
+workers_free(void) {
+	while (workers) {
+		struct worker *wk = workers;
+		workers = wk->next;
+		tjDestroy(wk->dec);
+		tjDestroy(wk->xf);
+		tjFree(wk->src);
+		free(wk->data);
+		free(wk);
+	}
+}
 
+/* read the st_size bytes of path into the worker's source buffer */
 static int
-findborder(const uint8_t *data, int is, int ie, int os, int oe, int od, int iM, int oM) {
-	int ret = margin;
-	for (int o = os; o != oe; o += od) {
-		int min = 1000.0;
-		int max = 0;
-		int di = 0;
-		int prev = -1;
-		for (int i = is; i < ie; ++i) {
-			uint8_t v = data[o * oM + i * iM];
-			if (v < min)
-				min = v;
-			if (v > max)
-				max = v;
-			if (i) {
-				int delta = abs(prev - v);
-				if (delta > di) {
-					di = delta;
-				}
-			}
-			prev = v;
-		}
-		if (di > gradient && abs(min - max) > threshold) {
-			break;
+load(struct worker *wk, const char *path, const struct stat *st) {
+	int ret = 0;
+	FILE *fp;
+	size_t len = st->st_size;
+
+	if (!(fp = fopen(path, "rb"))) {
+		warn("fopen %s", path);
+		return 1;
+	}
+	if (len > wk->srccap) {
+		tjFree(wk->src);
+		if (!(wk->src = tjAlloc(len)))
+			err(1, "tjAlloc %lu", len);
+		wk->srccap = len;
+	}
+	if (fread(wk->src, len, 1, fp) != 1) {
+		warn("fread %s %lu", path, len);
+		ret = 1;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * The bytes of path: read into the worker's buffer, or mapped when
+ * larger than the memory limit, so that its pages can be dropped.
+ */
+static const uint8_t *
+source(struct worker *wk, const char *path, const struct stat *st) {
+	void *p;
+	int fd;
+
+	if ((size_t)st->st_size <= maxmem)
+		return load(wk, path, st) ? NULL : wk->src;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		warn("open %s", path);
+		return NULL;
+	}
+	p = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		warn("mmap %s", path);
+		return NULL;
+	}
+	madvise(p, st->st_size, MADV_SEQUENTIAL);
+	return p;
+}
+
+static void
+unsource(struct worker *wk, const uint8_t *src, const struct stat *st) {
+	if (src != wk->src)
+		munmap((void *)src, st->st_size);
+}
+
+static void
+fputjstr(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/* called with prlock held */
+static void
+plan_add(const char *path, const struct stat *st, int x, int y, int w, int h) {
+	fprintf(planfp, planfirst ? "\n\t{\"path\":" : ",\n\t{\"path\":");
+	fputjstr(planfp, path);
+	fprintf(planfp, ",\"size\":%ld,\"mtime\":%ld,\"mtime_nsec\":%ld,\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d}",
+	        (long)st->st_size, (long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec, x, y, w, h);
+	planfirst = false;
+}
+
+/*
+ * Open a temporary file next to path for the crop, so that the original,
+ * which may still be mapped as the source, is only replaced once the
+ * crop is complete.
+ */
+static FILE *
+setaside(const char *path, char **tmp) {
+	struct stat st;
+	FILE *fp;
+	int fd;
+
+	*tmp = emalloc(strlen(path) + 8);
+	sprintf(*tmp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(*tmp)) < 0) {
+		warn("mkstemp %s", *tmp);
+		free(*tmp);
+		return NULL;
+	}
+	if (stat(path, &st) == 0)
+		fchmod(fd, st.st_mode & 07777);
+	if (!(fp = fdopen(fd, "wb"))) {
+		warn("fdopen %s", *tmp);
+		close(fd);
+		unlink(*tmp);
+		free(*tmp);
+	}
+	return fp;
+}
+
+/*
+ * Close a file from setaside() and move it over path on success, first
+ * moving path aside unless clobbering; the temporary file is removed
+ * on failure.
+ */
+static int
+putback(FILE *fp, const char *path, char *tmp, int ret) {
+	char *old = NULL;
+
+	if (fclose(fp) != 0) {
+		warn("fclose %s", tmp);
+		ret = 1;
+	}
+	if (ret == 0 && !clobber) {
+		old = emalloc(strlen(path) + strlen(oldext) + 1);
+		sprintf(old, "%s%s", path, oldext);
+		if (rename(path, old) < 0) {
+			warn("cannot backup %s, skipping", path);
+			ret = 1;
 		}
-		++ret;
 	}
+	if (ret == 0 && rename(tmp, path) < 0) {
+		warn("rename %s", tmp);
+		if (old)
+			rename(old, path);
+		ret = 1;
+	}
+	if (ret != 0)
+		unlink(tmp);
+	free(old);
+	free(tmp);
 	return ret;
 }
 
 static int
-crop(const uint8_t *srcbuf, size_t srclen, const char *path, int x, int y, int w, int h) {
+crop(struct worker *wk, const uint8_t *srcbuf, size_t srclen, const char *path, int x, int y, int w, int h) {
 	int ret = 0;
-	FILE *fp = NULL;
+	FILE *fp;
 	size_t dstlen = 0;
 	uint8_t *dstbuf = NULL;
-	tjhandle th = NULL;
-	char *old = NULL;
+	char *tmp;
 
 	tjtransform tf = {
 		.options = TJXOPT_CROP | TJXOPT_PERFECT,
@@ -130,42 +353,103 @@ crop(const uint8_t *srcbuf, size_t srclen, const char *path, int x, int y, int w
 		.r.y = y,	.r.h = h,
 	};
 
-	if (!clobber) {
-		old = emalloc(strlen(path) + strlen(oldext) + 1);
-		sprintf(old, "%s%s", path, oldext);
-		if (rename(path, old) < 0) {
-			warn("cannot backup %s, skipping", path);
-			free(old);
-			return 1;
-		}
+	if (tj3Transform(wk->xf, srcbuf, srclen, 1, &dstbuf, &dstlen, &tf) < 0) {
+		warnx("cannot transform %s: %s", path, tjGetErrorStr2(wk->xf));
+		return 1;
 	}
-
-	if (!(th = tjInitTransform())) {
-		err(1, "tjInitTransform");
+	if (!(fp = setaside(path, &tmp))) {
+		free(dstbuf);
+		return 1;
+	}
+	if (fwrite(dstbuf, dstlen, 1, fp) != 1) {
+		warn("fwrite %s %lu", path, dstlen);
+		ret = 1;
 	}
-	if (tj3Transform(th, srcbuf, srclen, 1, &dstbuf, &dstlen, &tf) < 0) {
-		warnx("cannot transform %s: %s", path, tjGetErrorStr2(th));
-		tjDestroy(th);
+	free(dstbuf);
+	return putback(fp, path, tmp, ret);
+}
+
+/* the crop of an image too large for the buffers of crop() */
+static int
+crop_stream(const uint8_t *srcbuf, size_t srclen, const char *path, int x, int y, int w, int h) {
+	FILE *fp;
+	char *tmp;
+	int ret = 0;
+
+	if (!(fp = setaside(path, &tmp)))
 		return 1;
+	if (jpgcrop(srcbuf, srclen, fp, x, y, w, h, maxmem)) {
+		warnx("cannot transform %s", path);
+		ret = 1;
 	}
-	tjDestroy(th);
+	return putback(fp, path, tmp, ret);
+}
 
+/* the exact formats, re-encoding the pixels of the box */
+static int
+exactput(const struct exact *fmt, const uint8_t *srcbuf, size_t srclen, const char *path, int x, int y, int w, int h) {
+	FILE *fp;
+	char *tmp;
+	int ret = 0;
 
-	if (!(fp = fopen(path, "wb"))) {
-		warn("fopen %s", path);
+	if (!(fp = setaside(path, &tmp)))
+		return 1;
+	if (fmt->crop(srcbuf, srclen, fp, x, y, w, h)) {
+		warnx("cannot crop %s", path);
 		ret = 1;
-	} else {
-		if (fwrite(dstbuf, dstlen, 1, fp) != 1) {
-			warn("fwrite %s %lu", path, dstlen);
-			ret = 1;
-		}
 	}
-	if (ret != 0 && old)
-		rename(old, path);
-	fclose(fp);
-	free(old);
-	free(dstbuf);
-	return ret;
+	return putback(fp, path, tmp, ret);
+}
+
+/* the exact format of a file, or NULL for JPEGs */
+static const struct exact *
+exactfmt(const uint8_t *buf, size_t len) {
+	for (size_t i = 0; i < sizeof(exacts) / sizeof(*exacts); ++i) {
+		if (exacts[i].is(buf, len))
+			return &exacts[i];
+	}
+	return NULL;
+}
+
+/* print and plan a crop, called for borders larger than the margin */
+static void
+report(const char *path, const struct stat *st, const struct borders *bd, int w, int h,
+       bool do_crop, int cx, int cy, int cw, int ch) {
+	if (verbose > 1 || (verbose && do_crop)) {
+		pthread_mutex_lock(&prlock);
+		printf("%s %d l=%d t=%d r=%d b=%d (%dx%d) %dx%d+%d+%d\n",
+		       path, do_crop, bd->l, bd->t, bd->r, bd->b, w, h, cw, ch, cx, cy);
+		pthread_mutex_unlock(&prlock);
+	}
+	if (do_crop && planfp) {
+		pthread_mutex_lock(&prlock);
+		plan_add(path, st, cx, cy, cw, ch);
+		pthread_mutex_unlock(&prlock);
+	}
+}
+
+static int
+handle_exact(struct worker *wk, const struct exact *fmt, const uint8_t *srcbuf, const char *path, const struct stat *st) {
+	struct borders bd;
+	int w, h;
+
+	if (fmt->gray(srcbuf, st->st_size, &wk->data, &wk->datacap, &w, &h)) {
+		warnx("unable to decode: %s", path);
+		return 1;
+	}
+	findborders(&parm, wk->data, w, h, &bd);
+	if (verbose > 2)
+		warnx("%s: decoded %.1f%% of %dx%d", path, 100.0, w, h);
+	if (!hasborder(&parm, &bd))
+		return 0;
+
+	int box[4];
+	bool do_crop = trimbox(&bd, w, h, 0, 0, box);
+
+	report(path, st, &bd, w, h, do_crop, box[0], box[1], box[2], box[3]);
+	if (do_crop && !dry_run)
+		return exactput(fmt, srcbuf, st->st_size, path, box[0], box[1], box[2], box[3]);
+	return 0;
 }
 
 #define CLAMPCROP(var, mod) do { 				\
@@ -178,84 +462,300 @@ static int
 handle(const char *path) {
 	int ret = 0;
 	struct stat st;
-	FILE *fp = NULL;
-	uint8_t *srcbuf = NULL;
-	uint8_t *data = NULL;
-	tjhandle th;
+	struct worker *wk = worker();
+	const uint8_t *srcbuf;
+	const struct exact *fmt;
+	uint8_t *data;
 	int w, h, ss, cs;
+	bool large;
 
-	if (!(th = tjInitDecompress())) {
-		errx(1, "Unable to initialize");
-	}
 	if (stat(path, &st) < 0) {
 		warn("stat %s", path);
 		return 1;
 	}
-	if (!(fp = fopen(path, "rb"))) {
-		warn("fopen %s", path);
+	if (!(srcbuf = source(wk, path, &st)))
 		return 1;
-	}
 	size_t srclen = st.st_size;
-	if (!(srcbuf = tjAlloc(srclen)))
-		err(1, "tjAlloc %lu", srclen);
-	if (fread(srcbuf, srclen, 1, fp) != 1) {
-		warn("fread %s %lu", path, srclen);
-		ret = 1;
+
+	if ((fmt = exactfmt(srcbuf, srclen))) {
+		ret = handle_exact(wk, fmt, srcbuf, path, &st);
 		goto jpegbail;
 	}
-	fclose(fp);
-	fp = NULL;
 
-	if (tjDecompressHeader3(th, srcbuf, srclen, &w, &h, &ss, &cs) < 0) {
+	if (tjDecompressHeader3(wk->dec, srcbuf, srclen, &w, &h, &ss, &cs) < 0) {
 		warnx("unable to read header: %s", path);
 		ret = 1;
 		goto jpegbail;
 	}
 
-	data = emalloc(w * h * sizeof(*data));
+	struct borders bd;
+	size_t work = 0;
 
-	if (tjDecompress2(th, srcbuf, srclen, data, w, 0, h, TJPF_GRAY, 0) < 0) {
-		warnx("unable to decompress: %s", path);
-		goto jpegbail;
+	large = (size_t)w * h > maxmem;
+	if (full_decode || jpgborders(&parm, srcbuf, srclen, w, h, maxmem, &bd, &work)) {
+		if (large) {
+			warnx("%s: too large to decode whole, skipping", path);
+			goto jpegbail;
+		}
+		if ((size_t)w * h > wk->datacap) {
+			free(wk->data);
+			wk->datacap = (size_t)w * h;
+			wk->data = emalloc(wk->datacap * sizeof(*wk->data));
+		}
+		data = wk->data;
+
+		if (tjDecompress2(wk->dec, srcbuf, srclen, data, w, 0, h, TJPF_GRAY, 0) < 0) {
+			warnx("unable to decompress: %s", path);
+			goto jpegbail;
+		}
+		findborders(&parm, data, w, h, &bd);
+		work += (size_t)w * h;
 	}
+	if (verbose > 2)
+		warnx("%s: decoded %.1f%% of %dx%d", path, 100.0 * work / ((double)w * h), w, h);
+	if (hasborder(&parm, &bd)) {
+		int box[4];
+		bool do_crop = trimbox(&bd, w, h, tjMCUWidth[ss], tjMCUHeight[ss], box);
+		int cx = box[0], cy = box[1], cw = box[2], ch = box[3];
 
-	int mt = findborder(data, 0, w, 0,     h - 1, +1, 1, w);
-	int mb = findborder(data, 0, w, h - 1, -1,    -1, 1, w);
-	int ml = findborder(data, mt, h - mb, 0,     w - 1, +1, w, 1);
-	int mr = findborder(data, mt, h - mb, w - 1, -1,    -1, w, 1);
-
-	if (mt > margin || mb > margin || ml > margin || mr > margin) {
-		int xmod = tjMCUWidth[ss];
-		int ymod = tjMCUHeight[ss];
-		int xm = ml % xmod;
-		int ym = mt % ymod;
-		int cx = ml + (xmod - xm);
-		int cy = mt + (ymod - ym);
-		int cw = w - mr - xm - cx; cw -= cw % xmod;
-		int ch = h - mb - ym - cy; ch -= ch % ymod;
-		bool do_crop = cx + cw <= w && cy + ch <= h;
-		if (verbose > 1 || (verbose && do_crop))
-			printf("%s %d l=%d t=%d r=%d b=%d (%dx%d) %dx%d+%d+%d\n",
-			       path, do_crop, ml, mt, mr, mb, w, h, cw, ch, cx, cy);
-		if (do_crop && !dry_run) {
-			ret |= crop(srcbuf, srclen, path, cx, cy, cw, ch);
+		report(path, &st, &bd, w, h, do_crop, cx, cy, cw, ch);
+		if (do_crop && !dry_run && large) {
+			ret |= crop_stream(srcbuf, srclen, path, cx, cy, cw, ch);
+		} else if (do_crop && !dry_run) {
+			ret |= crop(wk, srcbuf, srclen, path, cx, cy, cw, ch);
 		}
 	}
 
 jpegbail:
-	free(data);
-	tjDestroy(th);
-	tjFree(srcbuf);
-	if (fp)
-		fclose(fp);
+	unsource(wk, srcbuf, &st);
 	return ret;
 }
 
+static void
+handle_job(void *arg) {
+	char *path = arg;
+
+	if (handle(path))
+		__atomic_store_n(&status, 1, __ATOMIC_RELAXED);
+	free(path);
+}
+
+static void
+run(void (*fn)(void *), void *arg) {
+	if (threads)
+		thpool_add_work(threads, fn, arg);
+	else
+		fn(arg);
+}
+
+static void
+submit(const char *path) {
+	char *p = strdup(path);
+
+	if (!p)
+		err(1, "strdup");
+	run(handle_job, p);
+}
+
+/* whether a planned box lies in a w x h image, on its grid of xmod x ymod */
+static bool
+inside(const struct planent *pe, int w, int h, int xmod, int ymod) {
+	return pe->x >= 0 && pe->y >= 0 && pe->w <= w - pe->x && pe->h <= h - pe->y
+	    && pe->x % xmod == 0 && pe->y % ymod == 0;
+}
+
+/*
+ * The crop alone, as the file was already decoded when planning. The
+ * box is checked against the file all the same, as plans are easily
+ * edited.
+ */
+static int
+apply(const struct planent *pe) {
+	struct worker *wk = worker();
+	struct stat st;
+	const uint8_t *src;
+	int w, h, ss, cs, xmod, ymod, ret;
+	const struct exact *fmt;
+
+	if (stat(pe->path, &st) < 0) {
+		warn("stat %s", pe->path);
+		return 1;
+	}
+	if (st.st_size != pe->size || st.st_mtim.tv_sec != pe->mtime || st.st_mtim.tv_nsec != pe->mtime_nsec) {
+		if (verbose)
+			warnx("%s changed since planned, skipping", pe->path);
+		return 0;
+	}
+	if (!(src = source(wk, pe->path, &st)))
+		return 1;
+	fmt = exactfmt(src, st.st_size);
+	if (fmt ? fmt->size(src, st.st_size, &w, &h) : tjDecompressHeader3(wk->dec, src, st.st_size, &w, &h, &ss, &cs) < 0) {
+		warnx("unable to read header: %s", pe->path);
+		ret = 1;
+		goto done;
+	}
+	/* exact formats crop anywhere, JPEGs on whole iMCUs from the top left */
+	xmod = ymod = 1;
+	if (!fmt && ss >= 0) {
+		xmod = tjMCUWidth[ss];
+		ymod = tjMCUHeight[ss];
+	}
+	if ((!fmt && ss < 0) || !inside(pe, w, h, xmod, ymod)) {
+		warnx("%s: cannot crop %dx%d image to %dx%d+%d+%d", pe->path, w, h, pe->w, pe->h, pe->x, pe->y);
+		ret = 1;
+		goto done;
+	}
+	if (verbose) {
+		pthread_mutex_lock(&prlock);
+		printf("%s %dx%d+%d+%d\n", pe->path, pe->w, pe->h, pe->x, pe->y);
+		pthread_mutex_unlock(&prlock);
+	}
+	if (dry_run) {
+		ret = 0;
+	} else if (fmt) {
+		ret = exactput(fmt, src, st.st_size, pe->path, pe->x, pe->y, pe->w, pe->h);
+	} else if ((size_t)w * h > maxmem) {
+		ret = crop_stream(src, st.st_size, pe->path, pe->x, pe->y, pe->w, pe->h);
+	} else {
+		ret = crop(wk, src, st.st_size, pe->path, pe->x, pe->y, pe->w, pe->h);
+	}
+done:
+	unsource(wk, src, &st);
+	return ret;
+}
+
+static void
+apply_job(void *arg) {
+	struct planent *pe = arg;
+
+	if (apply(pe))
+		__atomic_store_n(&status, 1, __ATOMIC_RELAXED);
+	free(pe->path);
+	free(pe);
+}
+
+static int
+jstr(void *ctx, const unsigned char *str, size_t len) {
+	struct jstate *js = ctx;
+
+	if (js->ent && !strcmp(js->key, "path")) {
+		free(js->ent->path);
+		if (!(js->ent->path = strndup((const char *)str, len)))
+			err(1, "strndup");
+	}
+	return 1;
+}
+
+#define STOREATIF(attr, name) do {	\
+	if (!strcmp(js->key, name)) {	\
+		js->ent->attr = val;	\
+		return 1;		\
+	} } while (0)
+
+/* the box is kept in ints */
+#define STOREINTIF(attr, name) do {		\
+	if (!strcmp(js->key, name)) {		\
+		if (val < INT_MIN || val > INT_MAX)	\
+			return 0;		\
+		js->ent->attr = val;		\
+		return 1;			\
+	} } while (0)
+
+static int
+jnum(void *ctx, const char *str, size_t len) {
+	struct jstate *js = ctx;
+	char *end;
+	long val;
+
+	errno = 0;
+	val = strtol(str, &end, 10);
+	if (end - str != (long)len || errno)
+		return 0;
+	if (!js->ent)
+		return 1;
+	STOREATIF(size, "size");
+	STOREATIF(mtime, "mtime");
+	STOREATIF(mtime_nsec, "mtime_nsec");
+	STOREINTIF(x, "x");
+	STOREINTIF(y, "y");
+	STOREINTIF(w, "w");
+	STOREINTIF(h, "h");
+	return 1;
+}
+
+static int
+jkey(void *ctx, const unsigned char *str, size_t len) {
+	struct jstate *js = ctx;
+	/* all keys we care about are short, others never match */
+	if (len >= sizeof(js->key))
+		len = 0;
+	memcpy(js->key, str, len);
+	js->key[len] = 0;
+	return 1;
+}
+
+static int
+jmaps(void *ctx) {
+	struct jstate *js = ctx;
+
+	if (js->ent)
+		return 0;
+	js->ent = ecalloc(1, sizeof(*js->ent));
+	js->ent->size = -1;
+	return 1;
+}
+
+static int
+jmape(void *ctx) {
+	struct jstate *js = ctx;
+	struct planent *pe = js->ent;
+
+	if (!pe->path || pe->size < 0 || pe->w <= 0 || pe->h <= 0)
+		return 0;
+	run(apply_job, pe);
+	js->ent = NULL;
+	*js->key = 0;
+	return 1;
+}
+
+static yajl_callbacks jcb = {
+	.yajl_string = jstr,
+	.yajl_start_map = jmaps,
+	.yajl_map_key = jkey,
+	.yajl_end_map = jmape,
+	.yajl_number = jnum,
+};
+
+static void
+apply_plan(const char *path) {
+	struct jstate js = { 0 };
+	yajl_handle hand = yajl_alloc(&jcb, NULL, &js);
+	FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	uint8_t data[4096];
+	size_t rd;
+
+	if (!fp)
+		err(1, "fopen %s", path);
+	while ((rd = fread(data, 1, sizeof(data), fp))) {
+		if (yajl_parse(hand, data, rd) != yajl_status_ok)
+			errx(1, "Unable to parse plan past %lu in %s",
+			     yajl_get_bytes_consumed(hand), path);
+	}
+	if (ferror(fp))
+		err(1, "fread %s", path);
+	if (yajl_complete_parse(hand) != yajl_status_ok)
+		errx(1, "Truncated plan %s", path);
+	yajl_free(hand);
+	if (fp != stdin)
+		fclose(fp);
+}
+
 int
 main(int argc, char *argv[]) {
-	int ret = 0;
 	struct optparse op;
 	long opt;
+	bool from_stdin = false;
+	int delim = '\n';
 
 	optparse_init(&op, argv);
 	while ((opt = optparse_long(&op, longopts, NULL)) != -1) {
@@ -277,14 +777,37 @@ main(int argc, char *argv[]) {
 		case 'o':
 			oldext = op.optarg;
 			break;
+		case 'T':
+			nthreads = atoi(op.optarg);
+			break;
+		case 'i':
+			from_stdin = true;
+			break;
+		case '0':
+			from_stdin = true;
+			delim = '\0';
+			break;
+		case 'F':
+			full_decode = true;
+			break;
+		case 'M':
+			maxmem = (size_t)atol(op.optarg) << 20;
+			break;
+		case 'P':
+			planpath = op.optarg;
+			dry_run = true;
+			break;
+		case 'A':
+			applypath = op.optarg;
+			break;
 		case 't':
-			threshold = atoi(op.optarg);
+			parm.threshold = atoi(op.optarg);
 			break;
 		case 'g':
-			gradient = atoi(op.optarg);
+			parm.gradient = atoi(op.optarg);
 			break;
 		case 'm':
-			margin = atoi(op.optarg);
+			parm.margin = atoi(op.optarg);
 			break;
 
 		case '?':
@@ -302,12 +825,46 @@ main(int argc, char *argv[]) {
 
 	argv += op.optind;
 	argc -= op.optind;
-	if (!argc)
+	if (applypath ? argc || from_stdin || planpath : !!argc == from_stdin)
 		usage();
 
-	for (int i = 0; i < argc; ++i) {
-		ret |= handle(argv[i]);
+	if (planpath) {
+		if (!(planfp = fopen(planpath, "w")))
+			err(1, "fopen %s", planpath);
+		fprintf(planfp, "[");
+	}
+	if (nthreads > 1)
+		threads = thpool_init(nthreads);
+
+	if (applypath) {
+		apply_plan(applypath);
+	} else if (from_stdin) {
+		ssize_t r;
+		size_t len;
+		char *buf = NULL;
+		while ((r = getdelim(&buf, &len, delim, stdin)) != -1) {
+			if (r && buf[r - 1] == delim)
+				buf[r - 1] = '\0';
+			if (*buf)
+				submit(buf);
+		}
+		free(buf);
+	} else {
+		for (int i = 0; i < argc; ++i) {
+			submit(argv[i]);
+		}
+	}
+
+	if (threads) {
+		thpool_wait(threads);
+		thpool_destroy(threads);
+	}
+	workers_free();
+	if (planfp) {
+		fprintf(planfp, "\n]\n");
+		if (fclose(planfp))
+			err(1, "write %s", planpath);
 	}
 
-	return ret ? 1 : 0;
+	return status;
 }
@@ -0,0 +1,143 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "phash.h"
+
+static const double DCT_O[] = { /* √(2/N) * cos(п / 2N * y * (2x + 1)) */
+	+0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000, +0.500000000000,
+	+0.490392640202, +0.415734806151, +0.277785116510, +0.097545161008, -0.097545161008, -0.277785116510, -0.415734806151, -0.490392640202,
+	+0.461939766256, +0.191341716183, -0.191341716183, -0.461939766256, -0.461939766256, -0.191341716183, +0.191341716183, +0.461939766256,
+	+0.415734806151, -0.097545161008, -0.490392640202, -0.277785116510, +0.277785116510, +0.490392640202, +0.097545161008, -0.415734806151,
+	+0.353553390593, -0.353553390593, -0.353553390593, +0.353553390593, +0.353553390593, -0.353553390593, -0.353553390593, +0.353553390593,
+	+0.277785116510, -0.490392640202, +0.097545161008, +0.415734806151, -0.415734806151, -0.097545161008, +0.490392640202, -0.277785116510,
+	+0.191341716183, -0.461939766256, +0.461939766256, -0.191341716183, -0.191341716183, +0.461939766256, -0.461939766256, +0.191341716183,
+	+0.097545161008, -0.277785116510, +0.415734806151, -0.490392640202, +0.490392640202, -0.415734806151, +0.277785116510, -0.097545161008,
+};
+static const double DCT_T[] = {
+	+0.500000000000, +0.490392640202, +0.461939766256, +0.415734806151, +0.353553390593, +0.277785116510, +0.191341716183, +0.097545161008,
+	+0.500000000000, +0.415734806151, +0.191341716183, -0.097545161008, -0.353553390593, -0.490392640202, -0.461939766256, -0.277785116510,
+	+0.500000000000, +0.277785116510, -0.191341716183, -0.490392640202, -0.353553390593, +0.097545161008, +0.461939766256, +0.415734806151,
+	+0.500000000000, +0.097545161008, -0.461939766256, -0.277785116510, +0.353553390593, +0.415734806151, -0.191341716183, -0.490392640202,
+	+0.500000000000, -0.097545161008, -0.461939766256, +0.277785116510, +0.353553390593, -0.415734806151, -0.191341716183, +0.490392640202,
+	+0.500000000000, -0.277785116510, -0.191341716183, +0.490392640202, -0.353553390593, -0.097545161008, +0.461939766256, -0.415734806151,
+	+0.500000000000, -0.415734806151, +0.191341716183, +0.097545161008, -0.353553390593, +0.490392640202, -0.461939766256, +0.277785116510,
+	+0.500000000000, -0.490392640202, +0.461939766256, -0.415734806151, +0.353553390593, -0.277785116510, +0.191341716183, -0.097545161008,
+};
+
+void
+scale_down(double *dst, const uint8_t *src, int w, int h) {
+	int Dy = h / 8;
+	int Dx = w / 8;
+	int i = 0;
+
+	int X0 = (w % 8) / 2;
+	int Y0 = (h % 8) / 2;
+
+	for (int y0 = 0; y0 < 8; ++y0) {
+		for (int x0 = 0; x0 < 8; ++x0) {
+			double sum = 0.0;
+			for (int dy = 0; dy < Dy; ++dy)
+			for (int dx = 0; dx < Dx; ++dx) {
+				int row = Y0 + y0 * Dy + dy;
+				int col = X0 + x0 * Dx + dx;
+				sum += src[w * row + col];
+			}
+			dst[i++] = sum / (Dx * Dy);
+			
+		}
+	}
+}
+
+uint64_t
+genhash(double *ebe) {
+	uint64_t ret, bit;
+	double dct[64];
+	int i;
+
+	for (i = 0; i < 64; ++i)
+		dct[i] = 0.0;
+	for (int y = 0; y < 8; ++y) {
+		const double *dct_row = DCT_O + 8 * y;
+		double *ret_row = dct + 8 * y;
+		for (int x = 0; x < 8; ++x) {
+			const double *dct_col = DCT_T + 8 * x;
+			double tmp = 0.0;
+			for (i = 0; i < 8; ++i) {
+				tmp += dct_row[i] * ebe[x + i * 8];
+			}
+			for (i = 0; i < 8; ++i) {
+				ret_row[i] += dct_col[i] * tmp;
+			}
+		}
+	}
+
+	for (ret = 0, bit = 1, i = 0; i < 64; ++i, bit <<= 1) {
+		if (dct[i] > 0.0) {
+			ret |= bit;
+		}
+	}
+	return ret;
+}
+
+uint64_t
+hflip(double *dst, const double *src) {
+	const double *p = src;
+	for (int y = 0; y < 8; ++y) {
+		for (int x = 7; x >= 0; --x) {
+			dst[8 * y + x] = *p++;
+		}
+	}
+	return genhash(dst);
+}
+
+uint64_t
+hrot1(double *dst, const double *src) {
+	const double *p = src;
+	for (int x = 7; x >= 0; --x) {
+		for (int y = 0; y < 8; ++y) {
+			dst[8 * y + x] = *p++;
+		}
+	}
+	return genhash(dst);
+}
+
+uint64_t
+hrot2(double *dst, const double *src) {
+	const double *p = src;
+	for (int y = 7; y >= 0; --y) {
+		for (int x = 7; x >= 0; --x) {
+			dst[8 * y + x] = *p++;
+		}
+	}
+	return genhash(dst);
+}
+
+uint64_t
+hrot3(double *dst, const double *src) {
+	const double *p = src;
+	for (int x = 0; x < 8; ++x) {
+		for (int y = 7; y >= 0; --y) {
+			dst[8 * y + x] = *p++;
+		}
+	}
+	return genhash(dst);
+}
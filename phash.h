@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * DCT hash of an image scaled down to 8x8 block means. The transforms
+ * write the rotated or flipped block to dst and hash it.
+ */
+void scale_down(double*, const uint8_t*, int, int);
+uint64_t genhash(double*);
+uint64_t hflip(double*, const double*);
+uint64_t hrot1(double*, const double*);
+uint64_t hrot2(double*, const double*);
+uint64_t hrot3(double*, const double*);
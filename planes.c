@@ -0,0 +1,260 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <Imlib2.h>
+
+#include "planes.h"
+#include "util.h"
+
+struct jerr {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+};
+
+/* a colour plane summed up a row at a time */
+struct shrink {
+	int w, cmax;
+	int oy;
+	int *ox;
+	uint32_t *sum;
+	uint32_t *cnt;
+};
+
+struct decode {
+	struct jpeg_decompress_struct ci;
+	struct jerr jerr;
+	struct shrink sk;
+	uint8_t *row;
+};
+
+static void
+jerr_exit(j_common_ptr ci) {
+	longjmp(((struct jerr *)ci->err)->env, 1);
+}
+
+static void
+jerr_output(j_common_ptr ci) {
+}
+
+/* sized as imgfacedetect scales images for its detector, but no larger */
+static void
+shrink_init(struct shrink *sk, struct planes *pl, int cmax) {
+	double wf = (double)cmax / pl->w;
+	double hf = (double)cmax / pl->h;
+	double f = wf < hf ? wf : hf;
+
+	memset(sk, 0, sizeof(*sk));
+	sk->w = pl->w;
+	sk->cmax = cmax;
+	pl->cw = f < 1 ? pl->w * f : pl->w;
+	pl->ch = f < 1 ? pl->h * f : pl->h;
+	pl->cw += !pl->cw;
+	pl->ch += !pl->ch;
+	pl->bgr = ecalloc((size_t)pl->cw * pl->ch, 3);
+	sk->sum = ecalloc((size_t)pl->cw * 3, sizeof(*sk->sum));
+	sk->cnt = ecalloc(pl->cw, sizeof(*sk->cnt));
+	sk->ox = emalloc(pl->w * sizeof(*sk->ox));
+	for (int x = 0; x < pl->w; ++x)
+		sk->ox[x] = (int64_t)x * pl->cw / pl->w;
+}
+
+static uint8_t
+clamp(double v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v + .5;
+}
+
+/* write out the averages of row oy, converting from YCbCr if ycc */
+static void
+shrink_flush(struct shrink *sk, struct planes *pl, int ycc) {
+	uint8_t *out = pl->bgr + (size_t)sk->oy * pl->cw * 3;
+
+	for (int x = 0; x < pl->cw; ++x) {
+		uint32_t n = sk->cnt[x] ? sk->cnt[x] : 1;
+		double a = (double)sk->sum[3 * x] / n;
+		double b = (double)sk->sum[3 * x + 1] / n;
+		double c = (double)sk->sum[3 * x + 2] / n;
+
+		if (ycc) {
+			out[3 * x + 0] = clamp(a + 1.772 * (b - 128));
+			out[3 * x + 1] = clamp(a - 0.344136 * (b - 128) - 0.714136 * (c - 128));
+			out[3 * x + 2] = clamp(a + 1.402 * (c - 128));
+		} else {
+			out[3 * x + 0] = clamp(c);
+			out[3 * x + 1] = clamp(b);
+			out[3 * x + 2] = clamp(a);
+		}
+	}
+	memset(sk->sum, 0, (size_t)pl->cw * 3 * sizeof(*sk->sum));
+	memset(sk->cnt, 0, pl->cw * sizeof(*sk->cnt));
+}
+
+/* row y of three channel pixels, gray ones when nc is 1 */
+static void
+shrink_row(struct shrink *sk, struct planes *pl, int y, const uint8_t *px, int nc, int ycc) {
+	int oy = (int64_t)y * pl->ch / pl->h;
+
+	if (oy != sk->oy)
+		shrink_flush(sk, pl, ycc);
+	sk->oy = oy;
+	for (int x = 0; x < sk->w; ++x, px += nc) {
+		uint32_t *s = sk->sum + 3 * sk->ox[x];
+		s[0] += px[0];
+		s[1] += px[nc > 1];
+		s[2] += px[2 * (nc > 1)];
+		sk->cnt[sk->ox[x]]++;
+	}
+}
+
+static void
+shrink_free(struct shrink *sk) {
+	free(sk->ox);
+	free(sk->sum);
+	free(sk->cnt);
+}
+
+/*
+ * Gray is the luma of YCbCr files, as decoding to gray would give it,
+ * and computed with libjpeg's weights from RGB ones; other colour
+ * spaces decode to gray only, or not at all.
+ */
+static void
+decode(struct decode *d, const uint8_t *buf, size_t len, int cmax, struct planes *pl) {
+	int ycc, nc;
+
+	jpeg_mem_src(&d->ci, buf, len);
+	jpeg_read_header(&d->ci, TRUE);
+	ycc = d->ci.jpeg_color_space == JCS_YCbCr;
+	if (!cmax || (!ycc && d->ci.jpeg_color_space != JCS_RGB))
+		d->ci.out_color_space = JCS_GRAYSCALE;
+	else
+		d->ci.out_color_space = d->ci.jpeg_color_space;
+	jpeg_start_decompress(&d->ci);
+
+	nc = d->ci.output_components;
+	pl->w = d->ci.output_width;
+	pl->h = d->ci.output_height;
+	pl->xmod = d->ci.max_h_samp_factor * DCTSIZE;
+	pl->ymod = d->ci.max_v_samp_factor * DCTSIZE;
+	pl->gray = emalloc((size_t)pl->w * pl->h);
+	if (cmax)
+		shrink_init(&d->sk, pl, cmax);
+	if (nc > 1)
+		d->row = emalloc((size_t)pl->w * nc);
+
+	while (d->ci.output_scanline < d->ci.output_height) {
+		int y = d->ci.output_scanline;
+		uint8_t *g = pl->gray + (size_t)y * pl->w;
+		JSAMPROW row = nc > 1 ? d->row : g;
+
+		jpeg_read_scanlines(&d->ci, &row, 1);
+		for (int x = 0; nc > 1 && x < pl->w; ++x) {
+			const uint8_t *p = row + 3 * x;
+			g[x] = ycc ? p[0] : (19595 * p[0] + 38470 * p[1] + 7471 * p[2] + 32768) >> 16;
+		}
+		if (cmax)
+			shrink_row(&d->sk, pl, y, row, nc, ycc);
+	}
+	if (cmax)
+		shrink_flush(&d->sk, pl, ycc);
+	jpeg_finish_decompress(&d->ci);
+}
+
+int
+jpgplanes(const uint8_t *buf, size_t len, int cmax, struct planes *pl) {
+	/* on the heap, as it's changed between setjmp() and longjmp() */
+	struct decode *d = ecalloc(1, sizeof(*d));
+	int ret = 1;
+
+	memset(pl, 0, sizeof(*pl));
+	d->ci.err = jpeg_std_error(&d->jerr.pub);
+	d->jerr.pub.error_exit = jerr_exit;
+	d->jerr.pub.output_message = jerr_output;
+	jpeg_create_decompress(&d->ci);
+	if (!setjmp(d->jerr.env)) {
+		decode(d, buf, len, cmax, pl);
+		ret = 0;
+	}
+	jpeg_destroy_decompress(&d->ci);
+	shrink_free(&d->sk);
+	free(d->row);
+	free(d);
+	if (ret)
+		planes_free(pl);
+	return ret;
+}
+
+/* gray weighted as imlib_grayscale() does it */
+int
+imlibplanes(const char *path, const uint8_t *buf, size_t len, int cmax, struct planes *pl) {
+	struct shrink sk;
+	uint8_t *row = NULL;
+	Imlib_Image im;
+
+	memset(pl, 0, sizeof(*pl));
+	if (!(im = imlib_load_image_mem(path, buf, len)))
+		return 1;
+	imlib_context_set_image(im);
+	pl->w = imlib_image_get_width();
+	pl->h = imlib_image_get_height();
+	pl->gray = emalloc((size_t)pl->w * pl->h);
+	if (cmax) {
+		shrink_init(&sk, pl, cmax);
+		row = emalloc((size_t)pl->w * 3);
+	}
+	for (int y = 0; y < pl->h; y++) {
+		uint8_t *g = pl->gray + (size_t)y * pl->w;
+
+		for (int x = 0; x < pl->w; x++) {
+			Imlib_Color color;
+			imlib_image_query_pixel(x, y, &color);
+			g[x] = .30 * color.red
+			     + .58 * color.green
+			     + .12 * color.blue;
+			if (cmax) {
+				row[3 * x + 0] = color.red;
+				row[3 * x + 1] = color.green;
+				row[3 * x + 2] = color.blue;
+			}
+		}
+		if (cmax)
+			shrink_row(&sk, pl, y, row, 3, 0);
+	}
+	if (cmax) {
+		shrink_flush(&sk, pl, 0);
+		shrink_free(&sk);
+		free(row);
+	}
+	imlib_free_image();
+	return 0;
+}
+
+void
+planes_free(struct planes *pl) {
+	free(pl->gray);
+	free(pl->bgr);
+	memset(pl, 0, sizeof(*pl));
+}
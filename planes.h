@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An image decoded once for every analyzer: the gray plane at full
+ * size, the same as turbojpeg and imlib_grayscale() give, and when
+ * cmax is not 0 a colour plane of cw x ch, scaled down by averaging
+ * to fit in cmax x cmax, BGR as OpenCV has it.
+ *
+ * JPEG crops are on a grid of xmod x ymod pixels, 0 for others.
+ */
+struct planes {
+	int w, h;
+	uint8_t *gray;
+	int cw, ch;
+	uint8_t *bgr;
+	int xmod, ymod;
+};
+
+int jpgplanes(const uint8_t*, size_t, int cmax, struct planes*);
+int imlibplanes(const char*, const uint8_t*, size_t, int cmax, struct planes*);
+void planes_free(struct planes*);
@@ -0,0 +1,213 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <limits.h>
+#include <string.h>
+#include <png.h>
+
+#include "pngtrim.h"
+#include "util.h"
+
+struct memsrc {
+	const uint8_t *buf;
+	size_t len;
+	size_t off;
+};
+
+static void
+memread(png_structp png, png_bytep out, png_size_t n) {
+	struct memsrc *src = png_get_io_ptr(png);
+
+	if (n > src->len - src->off)
+		png_error(png, "truncated");
+	memcpy(out, src->buf + src->off, n);
+	src->off += n;
+}
+
+/* failures are reported by the caller and warnings ignored, as for JPEGs */
+static void
+nofail(png_structp png, png_const_charp msg) {
+	png_longjmp(png, 1);
+}
+
+static void
+nowarn(png_structp png, png_const_charp msg) {
+}
+
+int
+ispng(const uint8_t *buf, size_t len) {
+	return len >= 8 && !png_sig_cmp(buf, 0, 8);
+}
+
+int
+pngsize(const uint8_t *buf, size_t len, int *w, int *h) {
+	uint32_t iw, ih;
+
+	if (len < 24 || !ispng(buf, len) || memcmp(buf + 12, "IHDR", 4))
+		return 1;
+	iw = (uint32_t)buf[16] << 24 | buf[17] << 16 | buf[18] << 8 | buf[19];
+	ih = (uint32_t)buf[20] << 24 | buf[21] << 16 | buf[22] << 8 | buf[23];
+	if (!iw || !ih || iw > INT_MAX || ih > INT_MAX)
+		return 1;
+	*w = iw;
+	*h = ih;
+	return 0;
+}
+
+int
+pnggray(const uint8_t *buf, size_t len, uint8_t **data, size_t *cap, int *w, int *h) {
+	struct memsrc src = { buf, len, 0 };
+	png_structp png;
+	png_infop info;
+	int passes;
+
+	if (!(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, nofail, nowarn)))
+		return 1;
+	if (!(info = png_create_info_struct(png)) || setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return 1;
+	}
+	png_set_read_fn(png, &src, memread);
+	png_read_info(png, info);
+	*w = png_get_image_width(png, info);
+	*h = png_get_image_height(png, info);
+
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_strip_alpha(png);
+	if (png_get_color_type(png, info) & PNG_COLOR_MASK_COLOR)
+		png_set_rgb_to_gray_fixed(png, 1, 29900, 58700);
+	passes = png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	if ((size_t)*w * *h > *cap) {
+		free(*data);
+		*cap = (size_t)*w * *h;
+		*data = emalloc(*cap);
+	}
+	/* interlaced images fill in the rows over several passes */
+	for (int p = 0; p < passes; ++p) {
+		for (int y = 0; y < *h; ++y)
+			png_read_row(png, *data + (size_t)y * *w, NULL);
+	}
+	png_destroy_read_struct(&png, &info, NULL);
+	return 0;
+}
+
+/* colour and resolution chunks that apply to the cropped image as is */
+static void
+copyinfo(png_structp png, png_infop info, png_structp out, png_infop oinfo) {
+	png_colorp pal;
+	png_bytep trans;
+	png_color_16p tcolor;
+	png_charp name;
+	png_bytep prof;
+	png_uint_32 proflen, rx, ry;
+	png_fixed_point gamma;
+	int n, comp, intent, unit;
+
+	if (png_get_PLTE(png, info, &pal, &n))
+		png_set_PLTE(out, oinfo, pal, n);
+	if (png_get_tRNS(png, info, &trans, &n, &tcolor))
+		png_set_tRNS(out, oinfo, trans, n, tcolor);
+	if (png_get_iCCP(png, info, &name, &comp, &prof, &proflen))
+		png_set_iCCP(out, oinfo, name, comp, prof, proflen);
+	else if (png_get_sRGB(png, info, &intent))
+		png_set_sRGB(out, oinfo, intent);
+	if (png_get_gAMA_fixed(png, info, &gamma))
+		png_set_gAMA_fixed(out, oinfo, gamma);
+	if (png_get_pHYs(png, info, &rx, &ry, &unit))
+		png_set_pHYs(out, oinfo, rx, ry, unit);
+}
+
+/*
+ * Interlaced images are read whole, as their last pass completes the
+ * first row; others are read a row at a time up to the end of the box.
+ */
+int
+pngcrop(const uint8_t *buf, size_t len, FILE *fp, int x, int y, int w, int h) {
+	struct memsrc src = { buf, len, 0 };
+	png_structp png = NULL, out = NULL;
+	png_infop info = NULL, oinfo = NULL;
+	/* on the heap, as they're changed between setjmp() and longjmp() */
+	png_bytep *rows = ecalloc(2, sizeof(*rows));
+	int ret = 1;
+
+	if (!(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, nofail, nowarn)) ||
+	    !(info = png_create_info_struct(png)) ||
+	    !(out = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, nofail, nowarn)) ||
+	    !(oinfo = png_create_info_struct(out)))
+		goto bail;
+	if (setjmp(png_jmpbuf(png)))
+		goto bail;
+	if (setjmp(png_jmpbuf(out)))
+		goto bail;
+
+	png_set_read_fn(png, &src, memread);
+	png_read_info(png, info);
+	int iw = png_get_image_width(png, info);
+	int ih = png_get_image_height(png, info);
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 || w > iw - x || h > ih - y)
+		goto bail;
+	/* as stored, unpacked to a byte a pixel below */
+	int depth = png_get_bit_depth(png, info);
+	int type = png_get_color_type(png, info);
+	png_set_packing(png);
+	int passes = png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	size_t rowbytes = png_get_rowbytes(png, info);
+	size_t bpp = png_get_channels(png, info) * (depth == 16 ? 2 : 1);
+
+	png_init_io(out, fp);
+	png_set_IHDR(out, oinfo, w, h, depth, type, PNG_INTERLACE_NONE,
+	             PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	copyinfo(png, info, out, oinfo);
+	png_write_info(out, oinfo);
+	png_set_packing(out);
+
+	if (passes > 1) {
+		rows[0] = emalloc(rowbytes * ih);
+		for (int p = 0; p < passes; ++p) {
+			for (int r = 0; r < ih; ++r)
+				png_read_row(png, rows[0] + r * rowbytes, NULL);
+		}
+		for (int r = y; r < y + h; ++r)
+			png_write_row(out, rows[0] + r * rowbytes + x * bpp);
+	} else {
+		rows[1] = emalloc(rowbytes);
+		for (int r = 0; r < y + h; ++r) {
+			png_read_row(png, rows[1], NULL);
+			if (r >= y)
+				png_write_row(out, rows[1] + x * bpp);
+		}
+	}
+	png_write_end(out, NULL);
+	ret = 0;
+bail:
+	png_destroy_read_struct(&png, &info, NULL);
+	png_destroy_write_struct(&out, &oinfo);
+	free(rows[0]);
+	free(rows[1]);
+	free(rows);
+	return ret;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Border trimming of PNGs held in memory. Rows are decoded one at a
+ * time: for the analysis straight into 8 bit grey, weighted like JPEG
+ * luma, and for the crop only as far as its last row, with each row
+ * in the box written out as soon as it's read.
+ *
+ * All return 0 on success. pnggray() grows *data to hold the image.
+ */
+int ispng(const uint8_t*, size_t);
+/* the dimensions in the IHDR */
+int pngsize(const uint8_t*, size_t, int *w, int *h);
+int pnggray(const uint8_t*, size_t, uint8_t **data, size_t *cap, int *w, int *h);
+int pngcrop(const uint8_t*, size_t, FILE*, int x, int y, int w, int h);
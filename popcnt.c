@@ -0,0 +1,204 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "popcnt.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86
+#include <immintrin.h>
+#endif
+
+static int
+dist_scalar(uint64_t a, uint64_t b) {
+	uint64_t x = a ^ b;
+
+	x -= (x >> 1) & 0x5555555555555555ULL;
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (x * 0x0101010101010101ULL) >> 56;
+}
+
+static uint64_t
+match_scalar(uint64_t ref, const uint64_t *hashes, size_t n, int threshold) {
+	uint64_t ret = 0;
+
+	for (size_t i = 0; i < n; ++i)
+		ret |= (uint64_t)(dist_scalar(ref, hashes[i]) <= threshold) << i;
+	return ret;
+}
+
+#ifdef X86
+__attribute__((target("popcnt")))
+static int
+dist_popcnt(uint64_t a, uint64_t b) {
+	return __builtin_popcountll(a ^ b);
+}
+
+__attribute__((target("popcnt")))
+static uint64_t
+match_popcnt(uint64_t ref, const uint64_t *hashes, size_t n, int threshold) {
+	uint64_t ret = 0;
+
+	for (size_t i = 0; i < n; ++i)
+		ret |= (uint64_t)(__builtin_popcountll(ref ^ hashes[i]) <= threshold) << i;
+	return ret;
+}
+
+/*
+ * Per lane counts by nibble lookup, summed into each 64 bit lane by
+ * the sum of absolute differences against zero.
+ */
+__attribute__((target("avx2,popcnt")))
+static uint64_t
+match_avx2(uint64_t ref, const uint64_t *hashes, size_t n, int threshold) {
+	const __m256i lut = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	const __m256i r = _mm256_set1_epi64x(ref);
+	const __m256i lim = _mm256_set1_epi64x(threshold);
+	uint64_t ret = 0;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_xor_si256(r, _mm256_loadu_si256((const __m256i *)(hashes + i)));
+		__m256i c = _mm256_add_epi8(
+			_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+			_mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+		__m256i gt = _mm256_cmpgt_epi64(_mm256_sad_epu8(c, _mm256_setzero_si256()), lim);
+		ret |= (uint64_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(gt)) & 0xf) << i;
+	}
+	for (; i < n; ++i)
+		ret |= (uint64_t)(__builtin_popcountll(ref ^ hashes[i]) <= threshold) << i;
+	return ret;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static uint64_t
+match_avx512(uint64_t ref, const uint64_t *hashes, size_t n, int threshold) {
+	const __m512i r = _mm512_set1_epi64(ref);
+	const __m512i lim = _mm512_set1_epi64(threshold);
+	uint64_t ret = 0;
+
+	for (size_t i = 0; i < n; i += 8) {
+		__mmask8 live = n - i >= 8 ? 0xff : (1u << (n - i)) - 1;
+		__m512i x = _mm512_xor_si512(r, _mm512_maskz_loadu_epi64(live, hashes + i));
+		__mmask8 m = _mm512_mask_cmple_epi64_mask(live, _mm512_popcnt_epi64(x), lim);
+		ret |= (uint64_t)m << i;
+	}
+	return ret;
+}
+#endif
+
+struct kernel {
+	const char *name;
+	int (*supported)(void);
+	int (*dist)(uint64_t, uint64_t);
+	uint64_t (*match)(uint64_t, const uint64_t*, size_t, int);
+};
+
+static int
+have_any(void) {
+	return 1;
+}
+
+#ifdef X86
+static int
+have_popcnt(void) {
+	return __builtin_cpu_supports("popcnt");
+}
+
+static int
+have_avx2(void) {
+	return __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("avx2");
+}
+
+static int
+have_avx512(void) {
+	return __builtin_cpu_supports("popcnt")
+	    && __builtin_cpu_supports("avx512f")
+	    && __builtin_cpu_supports("avx512vpopcntdq");
+}
+#endif
+
+/* best first */
+static const struct kernel kernels[] = {
+#ifdef X86
+	{ "avx512", have_avx512, dist_popcnt, match_avx512 },
+	{ "avx2",   have_avx2,   dist_popcnt, match_avx2 },
+	{ "popcnt", have_popcnt, dist_popcnt, match_popcnt },
+#endif
+	{ "scalar", have_any,    dist_scalar, match_scalar },
+};
+
+static const char *kname = "scalar";
+int (*hdist)(uint64_t, uint64_t) = dist_scalar;
+uint64_t (*hmatch)(uint64_t, const uint64_t*, size_t, int) = match_scalar;
+
+static void
+use(const struct kernel *k) {
+	kname = k->name;
+	hdist = k->dist;
+	hmatch = k->match;
+}
+
+__attribute__((constructor))
+static void
+popcnt_init(void) {
+#ifdef X86
+	__builtin_cpu_init();
+#endif
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); ++i) {
+		if (kernels[i].supported()) {
+			use(&kernels[i]);
+			return;
+		}
+	}
+}
+
+const char *
+popcnt_name(void) {
+	return kname;
+}
+
+/* select a kernel by name, -1 if unknown or not supported here */
+int
+popcnt_use(const char *name) {
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); ++i) {
+		if (!strcmp(kernels[i].name, name) && kernels[i].supported()) {
+			use(&kernels[i]);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+bool hcount_on = false;
+uint64_t hcount = 0;
+
+void
+hcount_add(uint64_t n) {
+	if (hcount_on)
+		__atomic_fetch_add(&hcount, n, __ATOMIC_RELAXED);
+}
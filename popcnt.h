@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HMATCH_MAX 64
+
+/*
+ * Hamming distance kernels, picked at startup for the CPU at hand so
+ * one binary runs everywhere.
+ *
+ * hdist() is the distance of two hashes. hmatch() tests a reference
+ * against a block of at most HMATCH_MAX candidates and sets bit i of
+ * the result when candidate i is within threshold of it.
+ */
+extern int (*hdist)(uint64_t, uint64_t);
+extern uint64_t (*hmatch)(uint64_t, const uint64_t*, size_t, int);
+
+const char *popcnt_name(void);
+int popcnt_use(const char*);
+
+/*
+ * Hash comparisons made by the matching code, for progress reports.
+ * Counted in bulk, per query or row, and only while hcount_on is set.
+ */
+extern bool hcount_on;
+extern uint64_t hcount;
+
+void hcount_add(uint64_t);
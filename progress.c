@@ -0,0 +1,180 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "progress.h"
+#include "stats.h"
+#include "util.h"
+
+#define TTY_INTERVAL 1
+
+static const char *
+si(char *buf, size_t len, double v) {
+	static const char units[] = " kMGTP";
+	int u = 0;
+
+	while (v >= 1000 && units[u + 1]) {
+		v /= 1000;
+		++u;
+	}
+	if (u)
+		snprintf(buf, len, "%.1f%c", v, units[u]);
+	else
+		snprintf(buf, len, "%.0f", v);
+	return buf;
+}
+
+static double
+rate(const struct pmetric *m, const double *prev, double secs) {
+	return secs > 0 ? (m->value - *prev) / secs : 0;
+}
+
+static void
+draw(struct progress *pr, uint64_t now, bool last) {
+	double secs = (now - pr->ttytime) * 1e-9;
+	char line[512], a[16], b[16];
+	size_t len = 0;
+
+	len += snprintf(line, sizeof(line), "%s:", pr->prog);
+	for (size_t i = 0; i < pr->n && len < sizeof(line); ++i) {
+		const struct pmetric *m = &pr->m[i];
+
+		if (!m->label)
+			continue;
+		if (m->type == PM_COUNTER)
+			len += snprintf(line + len, sizeof(line) - len, " %s %s (%s/s)", m->label,
+			                si(a, sizeof(a), m->value), si(b, sizeof(b), rate(m, &pr->ttyprev[i], secs)));
+		else
+			len += snprintf(line + len, sizeof(line) - len, " %s %s", m->label, si(a, sizeof(a), m->value));
+		pr->ttyprev[i] = m->value;
+	}
+	fprintf(stderr, "\r%s\033[K%s", line, last ? "\n" : "");
+	fflush(stderr);
+	pr->ttytime = now;
+}
+
+static void
+write_textfile(struct progress *pr, uint64_t now) {
+	double secs = (now - pr->filetime) * 1e-9;
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", pr->textfile, (int)getpid());
+	if (!(fp = fopen(tmp, "w"))) {
+		warn("fopen %s", tmp);
+		return;
+	}
+	for (size_t i = 0; i < pr->n; ++i) {
+		const struct pmetric *m = &pr->m[i];
+
+		if (m->type == PM_COUNTER) {
+			fprintf(fp, "# HELP %s_%s_total %s\n", pr->prog, m->name, m->help);
+			fprintf(fp, "# TYPE %s_%s_total counter\n", pr->prog, m->name);
+			fprintf(fp, "%s_%s_total %.0f\n", pr->prog, m->name, m->value);
+			fprintf(fp, "# HELP %s_%s_per_second %s, per second.\n", pr->prog, m->name, m->help);
+			fprintf(fp, "# TYPE %s_%s_per_second gauge\n", pr->prog, m->name);
+			fprintf(fp, "%s_%s_per_second %.3f\n", pr->prog, m->name, rate(m, &pr->fileprev[i], secs));
+			pr->fileprev[i] = m->value;
+		} else {
+			fprintf(fp, "# HELP %s_%s %s\n", pr->prog, m->name, m->help);
+			fprintf(fp, "# TYPE %s_%s gauge\n", pr->prog, m->name);
+			fprintf(fp, "%s_%s %.0f\n", pr->prog, m->name, m->value);
+		}
+	}
+	fprintf(fp, "# HELP %s_last_update_seconds Time of the last update of this file.\n", pr->prog);
+	fprintf(fp, "# TYPE %s_last_update_seconds gauge\n", pr->prog);
+	fprintf(fp, "%s_last_update_seconds %ld\n", pr->prog, (long)time(NULL));
+	if (fclose(fp) || rename(tmp, pr->textfile) < 0) {
+		warn("write %s", pr->textfile);
+		unlink(tmp);
+	}
+	pr->filetime = now;
+}
+
+static void
+update(struct progress *pr, bool last) {
+	uint64_t now = nsnow();
+
+	pr->sample(pr->m, pr->ctx);
+	if (pr->tty)
+		draw(pr, now, last);
+	if (pr->textfile && (last || now - pr->filetime >= pr->interval * 1000000000ULL))
+		write_textfile(pr, now);
+}
+
+static void *
+run(void *arg) {
+	struct progress *pr = arg;
+	int tick = pr->tty ? TTY_INTERVAL : pr->interval;
+	struct timespec ts;
+
+	pthread_mutex_lock(&pr->lock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	while (!pr->stop) {
+		ts.tv_sec += tick;
+		if (pthread_cond_timedwait(&pr->cond, &pr->lock, &ts) == ETIMEDOUT)
+			update(pr, false);
+	}
+	pthread_mutex_unlock(&pr->lock);
+	return NULL;
+}
+
+void
+progress_start(struct progress *pr) {
+	if (pr->tty && !isatty(2))
+		pr->tty = false;
+	if (!pr->tty && !pr->textfile)
+		return;
+	if (pr->interval < 1)
+		pr->interval = 1;
+	pr->ttyprev = ecalloc(pr->n, sizeof(*pr->ttyprev));
+	pr->fileprev = ecalloc(pr->n, sizeof(*pr->fileprev));
+	pr->ttytime = pr->filetime = nsnow();
+	pr->stop = false;
+	pthread_mutex_init(&pr->lock, NULL);
+	pthread_cond_init(&pr->cond, NULL);
+	if (pthread_create(&pr->thread, NULL, run, pr))
+		errx(1, "unable to start progress thread");
+}
+
+/* a last update with the final values */
+void
+progress_stop(struct progress *pr) {
+	if (!pr->ttyprev)
+		return;
+	pthread_mutex_lock(&pr->lock);
+	pr->stop = true;
+	pthread_cond_signal(&pr->cond);
+	pthread_mutex_unlock(&pr->lock);
+	pthread_join(pr->thread, NULL);
+	update(pr, true);
+	free(pr->ttyprev);
+	free(pr->fileprev);
+	pr->ttyprev = pr->fileprev = NULL;
+}
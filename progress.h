@@ -0,0 +1,45 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+enum pmtype { PM_COUNTER, PM_GAUGE };
+
+struct pmetric {
+	const char *name;
+	const char *help;
+	enum pmtype type;
+	const char *label;	/* on the progress line, if set */
+	double value;
+};
+
+/*
+ * Progress of a long run. A background thread has sample() fill in
+ * the metric values every so often, then redraws a status line on a
+ * terminal and/or rewrites a Prometheus textfile collector file,
+ * atomically through rename(). Counters are also shown, and written,
+ * as per second rates since the previous update.
+ */
+struct progress {
+	const char *prog;
+	const char *textfile;
+	bool tty;
+	int interval;		/* seconds between textfile writes */
+	struct pmetric *m;
+	size_t n;
+	void (*sample)(struct pmetric*, void *ctx);
+	void *ctx;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+	double *ttyprev;
+	double *fileprev;
+	uint64_t ttytime;
+	uint64_t filetime;
+};
+
+void progress_start(struct progress*);
+void progress_stop(struct progress*);
@@ -0,0 +1,110 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "stats.h"
+
+uint64_t
+nsnow(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* only the owning thread writes, so no read-modify-write is needed */
+void
+counter_add(uint64_t *c, uint64_t v) {
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+uint64_t
+counter_get(const uint64_t *c) {
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+void
+stage_add(struct stage *s, uint64_t ns) {
+	int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if (b >= STAGE_NBUCKETS)
+		b = STAGE_NBUCKETS - 1;
+	counter_add(&s->n, 1);
+	counter_add(&s->ns, ns);
+	counter_add(&s->hist[b], 1);
+	if (ns > counter_get(&s->max))
+		__atomic_store_n(&s->max, ns, __ATOMIC_RELAXED);
+}
+
+void
+stage_merge(struct stage *dst, const struct stage *src) {
+	uint64_t max = counter_get(&src->max);
+
+	dst->n += counter_get(&src->n);
+	dst->ns += counter_get(&src->ns);
+	if (max > dst->max)
+		dst->max = max;
+	for (int b = 0; b < STAGE_NBUCKETS; ++b)
+		dst->hist[b] += counter_get(&src->hist[b]);
+}
+
+/* upper bound of the bucket holding quantile q */
+uint64_t
+stage_quantile(const struct stage *s, double q) {
+	uint64_t want = q * s->n, seen = 0;
+
+	for (int b = 0; b < STAGE_NBUCKETS; ++b) {
+		seen += s->hist[b];
+		if (seen > want) {
+			uint64_t ub = b ? 1ULL << b : 0;
+			return ub < s->max ? ub : s->max;
+		}
+	}
+	return s->max;
+}
+
+void
+stage_fputs(FILE *fp, const char *name, const struct stage *s) {
+	fprintf(fp, "%-10s %9lu %10.3f s", name, s->n, s->ns * 1e-9);
+	if (s->n) {
+		fprintf(fp, "   avg %9.1f us  p50 %9.1f us  p99 %9.1f us  max %9.1f us",
+		        s->ns * 1e-3 / s->n, stage_quantile(s, 0.50) * 1e-3,
+		        stage_quantile(s, 0.99) * 1e-3, s->max * 1e-3);
+	}
+	fprintf(fp, "\n");
+}
+
+void
+stage_fputjson(FILE *fp, const char *name, const struct stage *s, bool first) {
+	int last = STAGE_NBUCKETS;
+
+	while (last > 0 && !s->hist[last - 1])
+		--last;
+	fprintf(fp, "%s\n\t\t\"%s\":{ \"n\":%lu, \"ns\":%lu, \"max_ns\":%lu, "
+	        "\"p50_ns\":%lu, \"p90_ns\":%lu, \"p99_ns\":%lu, \"log2_hist\":[",
+	        first ? "" : ",", name, s->n, s->ns, s->max,
+	        stage_quantile(s, 0.50), stage_quantile(s, 0.90), stage_quantile(s, 0.99));
+	for (int b = 0; b < last; ++b)
+		fprintf(fp, "%s%lu", b ? "," : "", s->hist[b]);
+	fprintf(fp, "] }");
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STAGE_NBUCKETS 40
+
+/*
+ * Latency of one processing stage: a count, the total and a log2
+ * histogram of nanoseconds. Bucket b holds [2^(b-1), 2^b) ns.
+ *
+ * A stage is updated by a single thread and may be read by any other
+ * through stage_merge(). Fields are accessed with relaxed atomics, so
+ * a report taken mid-run is approximate but never torn.
+ */
+struct stage {
+	uint64_t n;
+	uint64_t ns;
+	uint64_t max;
+	uint64_t hist[STAGE_NBUCKETS];
+};
+
+uint64_t nsnow(void);
+void counter_add(uint64_t*, uint64_t);
+uint64_t counter_get(const uint64_t*);
+void stage_add(struct stage*, uint64_t ns);
+void stage_merge(struct stage*, const struct stage*);
+uint64_t stage_quantile(const struct stage*, double);
+void stage_fputs(FILE*, const char *name, const struct stage*);
+void stage_fputjson(FILE*, const char *name, const struct stage*, bool first);
@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "trim.h"
+#include "util.h"
+
+/* columns at a time, a multiple of the vector width */
+#define LANES 32
+/* columns gathered at once when searching the sides */
+#define TILE 64
+
+/*
+ * A line is part of the border unless its pixels span more than the
+ * threshold and some step between neighbours exceeds the gradient.
+ */
+static int
+isborder(const struct trimparm *p, int min, int max, int grad) {
+	return !(grad > p->gradient && abs(max - min) > p->threshold);
+}
+
+/* fold row into the statistics of n columns, prev being the row above */
+static inline void
+colstep(uint8_t *restrict min, uint8_t *restrict max, uint16_t *restrict grad, const uint8_t *row, const uint8_t *prev, int n) {
+	for (int x = 0; x < n; ++x) {
+		uint8_t v = row[x];
+		uint16_t d = v > prev[x] ? v - prev[x] : prev[x] - v;
+		min[x] = v < min[x] ? v : min[x];
+		max[x] = v > max[x] ? v : max[x];
+		grad[x] = d > grad[x] ? d : grad[x];
+	}
+}
+
+static void
+linestat(const uint8_t *px, int n, int *min, int *max, int *grad) {
+	uint8_t lo[LANES], hi[LANES], d[LANES];
+	int i = 1, lmin = px[0], lmax = px[0], lgrad = 0;
+
+	for (int k = 0; k < LANES; ++k) {
+		lo[k] = hi[k] = px[0];
+		d[k] = 0;
+	}
+	for (; i + LANES <= n; i += LANES) {
+		for (int k = 0; k < LANES; ++k) {
+			uint8_t v = px[i + k], u = px[i + k - 1];
+			uint8_t s = v > u ? v - u : u - v;
+			lo[k] = v < lo[k] ? v : lo[k];
+			hi[k] = v > hi[k] ? v : hi[k];
+			d[k] = s > d[k] ? s : d[k];
+		}
+	}
+	for (int k = 0; k < LANES; ++k) {
+		lmin = lo[k] < lmin ? lo[k] : lmin;
+		lmax = hi[k] > lmax ? hi[k] : lmax;
+		lgrad = d[k] > lgrad ? d[k] : lgrad;
+	}
+	for (; i < n; ++i) {
+		int s = abs(px[i] - px[i - 1]);
+		lmin = px[i] < lmin ? px[i] : lmin;
+		lmax = px[i] > lmax ? px[i] : lmax;
+		lgrad = s > lgrad ? s : lgrad;
+	}
+	*min = lmin;
+	*max = lmax;
+	*grad = lgrad;
+}
+
+int
+rowborder(const struct trimparm *p, const uint8_t *data, int w, int os, int oe, int od) {
+	int ret = p->margin;
+
+	for (int o = os; o != oe; o += od) {
+		int min, max, grad;
+
+		linestat(data + (size_t)o * w, w, &min, &max, &grad);
+		if (!isborder(p, min, max, grad))
+			break;
+		++ret;
+	}
+	return ret;
+}
+
+/*
+ * A column that doesn't start at the top of the image begins with a
+ * step up from -1, as it always has in jpgtrim; the first row seeds
+ * the gradients accordingly.
+ */
+void
+colstats(struct colstats *cs, const uint8_t *data, int stride, int w, int n, int y) {
+	if (w > cs->cap) {
+		cs->cap = w;
+		cs->min = erealloc(cs->min, w * sizeof(*cs->min));
+		cs->max = erealloc(cs->max, w * sizeof(*cs->max));
+		cs->grad = erealloc(cs->grad, w * sizeof(*cs->grad));
+	}
+	cs->w = w;
+	for (int x = 0; x < w; ++x) {
+		cs->min[x] = cs->max[x] = data[x];
+		cs->grad[x] = y ? data[x] + 1 : 0;
+	}
+	for (int r = 1; r < n; ++r) {
+		const uint8_t *row = data + (size_t)r * stride;
+		int x = 0;
+
+		for (; x + LANES <= w; x += LANES)
+			colstep(cs->min + x, cs->max + x, cs->grad + x, row + x, row + x - stride, LANES);
+		colstep(cs->min + x, cs->max + x, cs->grad + x, row + x, row + x - stride, w - x);
+	}
+}
+
+int
+colborder(const struct trimparm *p, const struct colstats *cs, int os, int oe, int od) {
+	int ret = p->margin;
+
+	for (int o = os; o != oe; o += od) {
+		if (!isborder(p, cs->min[o], cs->max[o], cs->grad[o]))
+			break;
+		++ret;
+	}
+	return ret;
+}
+
+void
+colstats_free(struct colstats *cs) {
+	free(cs->min);
+	free(cs->max);
+	free(cs->grad);
+}
+
+/*
+ * Border columns of rows [y0, y1) from the left, or the right when
+ * dir is -1, gathered a tile at a time until the border ends in one.
+ */
+static int
+sideborder(const struct trimparm *p, struct colstats *cs, const uint8_t *data, int w, int y0, int y1, int dir) {
+	const uint8_t *rows = data + (size_t)y0 * w;
+	int end = dir > 0 ? w - 1 : w;
+	int ret = p->margin;
+
+	for (int x = 0; x < end; x += TILE) {
+		int n = end - x < TILE ? end - x : TILE;
+		int c;
+
+		if (dir > 0) {
+			colstats(cs, rows + x, w, n, y1 - y0, y0);
+			c = colborder(p, cs, 0, n, +1) - p->margin;
+		} else {
+			colstats(cs, rows + w - x - n, w, n, y1 - y0, y0);
+			c = colborder(p, cs, n - 1, -1, -1) - p->margin;
+		}
+		ret += c;
+		if (c < n)
+			break;
+	}
+	return ret;
+}
+
+/* left and right are only searched between the top and bottom borders */
+void
+findborders(const struct trimparm *p, const uint8_t *data, int w, int h, struct borders *bd) {
+	struct colstats cs = { 0 };
+	int y0, y1;
+
+	bd->t = rowborder(p, data, w, 0,     h - 1, +1);
+	bd->b = rowborder(p, data, w, h - 1, -1,    -1);
+	y0 = bd->t;
+	y1 = h - bd->b;
+	if (y0 >= y1) {
+		/* empty columns span 1000 with no steps, as they always have */
+		int all = isborder(p, 1000, 0, 0);
+		bd->l = p->margin + (all ? w - 1 : 0);
+		bd->r = p->margin + (all ? w : 0);
+		return;
+	}
+	bd->l = sideborder(p, &cs, data, w, y0, y1, +1);
+	bd->r = sideborder(p, &cs, data, w, y0, y1, -1);
+	colstats_free(&cs);
+}
+
+bool
+hasborder(const struct trimparm *p, const struct borders *bd) {
+	return bd->t > p->margin || bd->b > p->margin || bd->l > p->margin || bd->r > p->margin;
+}
+
+bool
+trimbox(const struct borders *bd, int w, int h, int xmod, int ymod, int *box) {
+	if (!xmod || !ymod) {
+		box[0] = bd->l;
+		box[1] = bd->t;
+		box[2] = w - bd->l - bd->r;
+		box[3] = h - bd->t - bd->b;
+		return box[2] > 0 && box[3] > 0;
+	}
+	int xm = bd->l % xmod;
+	int ym = bd->t % ymod;
+	box[0] = bd->l + (xmod - xm);
+	box[1] = bd->t + (ymod - ym);
+	box[2] = w - bd->r - xm - box[0]; box[2] -= box[2] % xmod;
+	box[3] = h - bd->b - ym - box[1]; box[3] -= box[3] % ymod;
+	return box[0] + box[2] <= w && box[1] + box[3] <= h;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+struct trimparm {
+	int threshold;	/* minimum luminosity range of a non-border line */
+	int gradient;	/* maximum step between pixels of a border line */
+	int margin;	/* cropped beyond the border */
+};
+
+#define TRIMPARM_DEFAULT { .threshold = 26, .gradient = 10, .margin = 4 }
+
+/* border widths including the margin */
+struct borders {
+	int t, b, l, r;
+};
+
+/*
+ * Minimum, maximum and largest step down each column of a run of
+ * rows, gathered a row at a time so the sides are scanned without
+ * striding through the image.
+ */
+struct colstats {
+	int w;
+	int cap;
+	uint8_t *min;
+	uint8_t *max;
+	uint16_t *grad;
+};
+
+/* border rows os, os + od, ... short of oe of a w pixels wide image */
+int rowborder(const struct trimparm*, const uint8_t*, int w, int os, int oe, int od);
+/* n >= 1 rows of w pixels, stride apart, the first being row y of the image */
+void colstats(struct colstats*, const uint8_t*, int stride, int w, int n, int y);
+int colborder(const struct trimparm*, const struct colstats*, int os, int oe, int od);
+void colstats_free(struct colstats*);
+void findborders(const struct trimparm*, const uint8_t*, int, int, struct borders*);
+/* whether any border is wider than the margin */
+bool hasborder(const struct trimparm*, const struct borders*);
+/*
+ * The box x, y, w, h inside the borders. On a grid of xmod x ymod, as
+ * JPEG crops are, it starts past the blocks the borders end in; with
+ * 0 it is exact. Returns whether it lies inside the image.
+ */
+bool trimbox(const struct borders*, int w, int h, int xmod, int ymod, int *box);
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "util.h"
 
 void *
@@ -23,3 +24,115 @@ emalloc(size_t size) {
 		err(1, "malloc %lu", size);
 	return p;
 }
+
+#define ARENA_CHUNKSIZ (1024 * 1024)
+#define ARENA_ALIGN    (_Alignof(max_align_t))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	size_t size;
+	max_align_t data[];
+};
+
+static struct arena_chunk *
+arena_chunk_new(size_t size) {
+	struct arena_chunk *c = ecalloc(1, sizeof(*c) + size);
+	c->size = size;
+	return c;
+}
+
+void *
+arena_alloc(struct arena *a, size_t size) {
+	size_t chunksiz = a->chunksiz ? a->chunksiz : ARENA_CHUNKSIZ;
+	struct arena_chunk *c = a->head;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (size > chunksiz / 4) {
+		/* oversized, give it a chunk of its own behind the current one */
+		c = arena_chunk_new(size);
+		if (a->head) {
+			c->next = a->head->next;
+			a->head->next = c;
+		} else {
+			a->head = c;
+		}
+	} else if (!c || c->size - c->used < size) {
+		c = arena_chunk_new(chunksiz);
+		c->next = a->head;
+		a->head = c;
+	}
+	p = (char *)c->data + c->used;
+	c->used += size;
+	return p;
+}
+
+char *
+arena_strndup(struct arena *a, const char *s, size_t len) {
+	char *ret = arena_alloc(a, len + 1);
+	memcpy(ret, s, len);
+	ret[len] = 0;
+	return ret;
+}
+
+char *
+arena_strdup(struct arena *a, const char *s) {
+	return arena_strndup(a, s, strlen(s));
+}
+
+void
+arena_free(struct arena *a) {
+	while (a->head) {
+		struct arena_chunk *next = a->head->next;
+		free(a->head);
+		a->head = next;
+	}
+}
+
+#define P1 0x9e3779b185ebca87ULL
+#define P2 0xc2b2ae3d27d4eb4fULL
+#define P3 0x165667b19e3779f9ULL
+
+static uint64_t
+rotl(uint64_t x, int r) {
+	return x << r | x >> (64 - r);
+}
+
+static uint64_t
+round64(uint64_t acc, uint64_t in) {
+	return rotl(acc + in * P2, 31) * P1;
+}
+
+static uint64_t
+avalanche(uint64_t h) {
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	return h ^ h >> 32;
+}
+
+/*
+ * 128 bits of four XXH64 style lanes over the buffer, to tell files
+ * apart, not to withstand anyone trying to collide them.
+ */
+void
+digest(const void *buf, size_t len, uint64_t out[2]) {
+	const uint8_t *p = buf;
+	uint64_t v[4] = { P1 + P2, P2, 0, -P1 };
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		for (int k = 0; k < 4; ++k) {
+			memcpy(&w, p + i + 8 * k, 8);
+			v[k] = round64(v[k], w);
+		}
+	}
+	for (int k = 0; i < len; ++i, k = (k + 1) % 4)
+		v[k] = round64(v[k], p[i]);
+	out[0] = avalanche(rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18) + len);
+	out[1] = avalanche((v[0] ^ rotl(v[1], 29)) * P1 + (v[2] ^ rotl(v[3], 37)) * P3 + len);
+}
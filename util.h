@@ -1,7 +1,26 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <err.h>
 void *ecalloc(size_t, size_t);
 void *emalloc(size_t);
 void *erealloc(void*, size_t);
+
+/*
+ * Bump allocator for many small, equally long-lived objects.
+ * Memory is zeroed, can't be freed individually and is released
+ * all at once by arena_free(). Not thread safe.
+ */
+struct arena {
+	struct arena_chunk *head;
+	size_t chunksiz;
+};
+
+void *arena_alloc(struct arena*, size_t);
+char *arena_strdup(struct arena*, const char*);
+char *arena_strndup(struct arena*, const char*, size_t);
+void arena_free(struct arena*);
+
+/* a digest of the bytes, for finding identical files */
+void digest(const void*, size_t, uint64_t[2]);
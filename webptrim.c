@@ -0,0 +1,183 @@
+/*
+ * Copyright © 2023 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <string.h>
+#include <webp/decode.h>
+#include <webp/encode.h>
+#include <webp/mux.h>
+
+#include "webptrim.h"
+#include "util.h"
+
+/* the chunks of an extended file kept in the crop */
+static const char *const keep[] = { "ICCP", "EXIF", "XMP " };
+
+int
+iswebp(const uint8_t *buf, size_t len) {
+	return len >= 12 && !memcmp(buf, "RIFF", 4) && !memcmp(buf + 8, "WEBP", 4);
+}
+
+int
+webpsize(const uint8_t *buf, size_t len, int *w, int *h) {
+	WebPBitstreamFeatures f;
+
+	if (!iswebp(buf, len) || WebPGetFeatures(buf, len, &f) != VP8_STATUS_OK || f.has_animation)
+		return 1;
+	*w = f.width;
+	*h = f.height;
+	return 0;
+}
+
+/* run the incremental decoder over the file, into config->output */
+static int
+decode(const uint8_t *buf, size_t len, WebPDecoderConfig *config) {
+	WebPIDecoder *idec;
+	VP8StatusCode st;
+
+	if (!(idec = WebPIDecode(NULL, 0, config)))
+		return 1;
+	st = WebPIUpdate(idec, buf, len);
+	WebPIDelete(idec);
+	return st != VP8_STATUS_OK;
+}
+
+int
+webpgray(const uint8_t *buf, size_t len, uint8_t **data, size_t *cap, int *w, int *h) {
+	WebPDecoderConfig config;
+	WebPYUVABuffer *yuv = &config.output.u.YUVA;
+	uint8_t full[256];
+	size_t n;
+	int ret;
+
+	if (!WebPInitDecoderConfig(&config) || webpsize(buf, len, w, h))
+		return 1;
+	n = (size_t)*w * *h;
+	if (n > *cap) {
+		free(*data);
+		*cap = n;
+		*data = emalloc(*cap);
+	}
+	/* luma straight into data, chroma into a buffer of its own */
+	size_t cw = (*w + 1) / 2, ch = (*h + 1) / 2;
+	uint8_t *uv = emalloc(2 * cw * ch);
+
+	config.output.colorspace = MODE_YUV;
+	config.output.is_external_memory = 1;
+	yuv->y = *data;
+	yuv->y_stride = *w;
+	yuv->y_size = n;
+	yuv->u = uv;
+	yuv->v = uv + cw * ch;
+	yuv->u_stride = yuv->v_stride = cw;
+	yuv->u_size = yuv->v_size = cw * ch;
+	ret = decode(buf, len, &config);
+	free(uv);
+	if (ret)
+		return 1;
+
+	/* WebP luma is limited to [16, 235], JPEG's is not */
+	for (int i = 0; i < 256; ++i)
+		full[i] = i <= 16 ? 0 : i >= 235 ? 255 : ((i - 16) * 255 + 109) / 219;
+	for (size_t i = 0; i < n; ++i)
+		(*data)[i] = full[(*data)[i]];
+	return 0;
+}
+
+/* the chunks kept from the original around the encoded box */
+static int
+remux(const uint8_t *buf, size_t len, const uint8_t *img, size_t imglen, WebPData *out) {
+	WebPData src = { buf, len }, enc = { img, imglen }, chunk;
+	WebPMux *in, *mux;
+	int ret = 1;
+
+	if (!(in = WebPMuxCreate(&src, 0)))
+		return 1;
+	if (!(mux = WebPMuxNew()))
+		goto bail;
+	if (WebPMuxSetImage(mux, &enc, 0) != WEBP_MUX_OK)
+		goto bail;
+	for (size_t i = 0; i < sizeof(keep) / sizeof(*keep); ++i) {
+		if (WebPMuxGetChunk(in, keep[i], &chunk) == WEBP_MUX_OK &&
+		    WebPMuxSetChunk(mux, keep[i], &chunk, 1) != WEBP_MUX_OK)
+			goto bail;
+	}
+	ret = WebPMuxAssemble(mux, out) != WEBP_MUX_OK;
+bail:
+	WebPMuxDelete(mux);
+	WebPMuxDelete(in);
+	return ret;
+}
+
+/*
+ * libwebp may round the top left corner of a decoder crop down to even,
+ * so the box is decoded from there and the odd pixel skipped.
+ */
+int
+webpcrop(const uint8_t *buf, size_t len, FILE *fp, int x, int y, int w, int h) {
+	WebPDecoderConfig config;
+	WebPRGBABuffer *rgba = &config.output.u.RGBA;
+	WebPData out = { NULL, 0 };
+	uint8_t *img = NULL;
+	size_t imglen;
+	int iw, ih, bpp, ret = 1;
+
+	if (!WebPInitDecoderConfig(&config) || webpsize(buf, len, &iw, &ih) ||
+	    WebPGetFeatures(buf, len, &config.input) != VP8_STATUS_OK)
+		return 1;
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 || w > iw - x || h > ih - y)
+		return 1;
+	config.options.use_cropping = 1;
+	config.options.crop_left = x & ~1;
+	config.options.crop_top = y & ~1;
+	config.options.crop_width = w + (x & 1);
+	config.options.crop_height = h + (y & 1);
+	config.output.colorspace = config.input.has_alpha ? MODE_RGBA : MODE_RGB;
+	bpp = config.input.has_alpha ? 4 : 3;
+	if (decode(buf, len, &config))
+		goto bail;
+
+	const uint8_t *box = rgba->rgba + (y & 1) * rgba->stride + (x & 1) * bpp;
+
+	/* format 2 is lossless */
+	if (config.input.format == 2)
+		imglen = bpp == 4 ? WebPEncodeLosslessRGBA(box, w, h, rgba->stride, &img)
+		                  : WebPEncodeLosslessRGB(box, w, h, rgba->stride, &img);
+	else
+		imglen = bpp == 4 ? WebPEncodeRGBA(box, w, h, rgba->stride, WEBP_QUALITY, &img)
+		                  : WebPEncodeRGB(box, w, h, rgba->stride, WEBP_QUALITY, &img);
+	if (!imglen)
+		goto bail;
+	/* only the extended format has chunks beside the image */
+	if (len >= 16 && !memcmp(buf + 12, "VP8X", 4)) {
+		if (remux(buf, len, img, imglen, &out))
+			goto bail;
+		ret = fwrite(out.bytes, out.size, 1, fp) != 1;
+	} else {
+		ret = fwrite(img, imglen, 1, fp) != 1;
+	}
+bail:
+	WebPDataClear(&out);
+	WebPFree(img);
+	WebPFreeDecBuffer(&config.output);
+	return ret;
+}
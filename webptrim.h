@@ -0,0 +1,22 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Border trimming of still WebPs held in memory, through the incremental
+ * decoder: for the analysis into the luma plane, expanded to full range
+ * like JPEG luma, and for the crop only the box, which libwebp stops
+ * decoding after. The box is encoded anew, losslessly for lossless files
+ * and at quality WEBP_QUALITY for lossy ones, whose own isn't recorded;
+ * ICC, EXIF and XMP chunks are copied.
+ *
+ * All return 0 on success. webpgray() grows *data to hold the image.
+ */
+#define WEBP_QUALITY 90
+
+int iswebp(const uint8_t*, size_t);
+/* the dimensions in the headers, failing for animations */
+int webpsize(const uint8_t*, size_t, int *w, int *h);
+int webpgray(const uint8_t*, size_t, uint8_t **data, size_t *cap, int *w, int *h);
+int webpcrop(const uint8_t*, size_t, FILE*, int x, int y, int w, int h);